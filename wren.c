@@ -1,8 +1,22 @@
 #include <assert.h>
-#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef NO_SERVER
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 /* Configuration */
 
@@ -12,6 +26,58 @@ enum {
 
 	/* True iff voluminous tracing is wanted. */
 	loud = 0,
+
+	/* Most tasks that can be alive at once, counting the main one. */
+	max_tasks = 8,
+
+	/* Bytes of the store given to the stack of each spawned task. */
+	task_stack_size = 256,
+
+	/* If nonzero, each task instead gets a stack this big outside the
+	   store, mapped with a guard page below it: deep recursion then
+	   fits, and pushes aren't checked, since overflowing hits the
+	   guard. */
+	vm_stack_size = 0,
+
+	/* Entries in the result cache of each 'memo fun' (a power of 2). */
+	memo_slots = 16,
+
+	/* Entries kept in the execution trace (see 'trace'). */
+	trace_size = 64,
+
+	/* Instructions a task may run before it's preempted, and how often
+	   we check for a keyboard interrupt. 0 means never: tasks then
+	   switch only when they yield, and ^C kills the whole program. */
+	time_slice = 0,
+
+	/* Most clients a server (see 'wren -s') talks to at once. */
+	max_sessions = 16,
+
+	/* Bytes of not-yet-compiled input a session has room for at first.
+	   A longer command gets more, up to store_capacity. */
+	session_input_size = 512,
+
+	/* True iff calls go through a slot just before each procedure's
+	   code, so that redefining it with 'fun' redirects its existing
+	   callers. Costs 2 bytes a procedure and a fetch a call. */
+	indirect_calls = 0,
+
+	/* Bytes in the longest string literal, counting its '\0'. */
+	max_string_size = 1024,
+
+	/* Most distinct string literals that later ones can share. */
+	max_strings = 256,
+
+	/* Most arms one 'case' may have. */
+	max_case_arms = 128,
+
+	/* Most files mapped at once (see 'mapfile'). */
+	max_mappings = 8,
+
+	/* Most threads one 'pmap' splits its range among, and the bytes
+	   of stack each gets (vm_stack_size instead, if that's set). */
+	max_workers = 8,
+	worker_stack_size = 4096,
 };
 
 /* Pick the definition that goes with the endianness of your computer.
@@ -27,12 +93,32 @@ enum {
 	(opcode)<<2|a_primitive, 0, ((name_length)<<4|(arity))
 #endif
 
-/* Type of a Wren-language value. */
-typedef int Value;
+/* Type of a Wren-language value, and its unsigned counterpart.
+   Build with -DVALUE_BITS=16 or 64 to change the width from 32: a 16-bit
+   Value halves the stack and globals, a 64-bit one saves on overflow. */
+#ifndef VALUE_BITS
+#define VALUE_BITS 32
+#endif
+
+#if VALUE_BITS == 16
+typedef int16_t Value;
+typedef uint16_t UValue;
+#define PRIdValue PRId16
+#elif VALUE_BITS == 32
+typedef int32_t Value;
+typedef uint32_t UValue;
+#define PRIdValue PRId32
+#elif VALUE_BITS == 64
+typedef int64_t Value;
+typedef uint64_t UValue;
+#define PRIdValue PRId64
+#else
+#error "VALUE_BITS must be 16, 32 or 64"
+#endif
 
-/* Error state */
+/* Error state (one per thread: see 'pmap') */
 
-static const char *complaint = NULL;
+static __thread const char *complaint = NULL;
 
 static void complain (const char *msg)
 {
@@ -40,6 +126,56 @@ static void complain (const char *msg)
 		complaint = msg;
 }
 
+/* Input and output
+
+   Ordinarily we read from 'input' and write to 'output', which are
+   stdin and stdout. A server session instead has its input arrive a
+   piece at a time into an Input buffer; running out of what's arrived
+   so far, before the client has closed its end, leaves us 'starved'.
+   That's only worth waiting out until the command has 'ran': after
+   that, going back for the rest would run it twice. */
+
+typedef struct Input Input;
+struct Input {
+	unsigned char *bytes;
+	unsigned size, length, position;
+	int closed;
+};
+
+static FILE *input;
+static FILE *output;
+static Input *input_buffer = NULL;
+static int starved = 0;
+static int ran = 0;
+
+static int read_char (void)
+{
+	if (!input_buffer)
+		return getc (input);
+	if (input_buffer->position < input_buffer->length)
+		return input_buffer->bytes[input_buffer->position++];
+	return EOF;
+}
+
+/* Read up to n bytes into 'p', stopping after a newline if 'line';
+   return how many we got. */
+static unsigned read_block (unsigned char *p, unsigned n, int line)
+{
+	unsigned count = 0;
+	if (!input_buffer && !line)
+		return fread (p, 1, n, input);
+	while (count < n)
+	{
+		int c = read_char ();
+		if (c == EOF)
+			break;
+		p[count++] = c;
+		if (line && c == '\n')
+			break;
+	}
+	return count;
+}
+
 /* Main data store in RAM
 
    Most of the memory we use is doled out of one block.
@@ -57,7 +193,7 @@ static void complain (const char *msg)
    the simplest solution.)
 
    At runtime, the stack grows down from the bottom of the dictionary
-   (but 32-bit word-aligned). 
+   (but aligned to a Value). 
    */
 
 typedef enum { a_primitive, a_procedure, a_global, a_local } NameKind;
@@ -70,18 +206,55 @@ struct Header {
 	unsigned char name[0];
 } __attribute__((packed));  /* XXX gcc dependency */
 
-static unsigned char the_store[store_capacity];
+static unsigned char the_store[store_capacity]
+	__attribute__((aligned (sizeof (Value))));  /* XXX gcc dependency */
 #define store_end  (the_store + store_capacity)
 
-/* We make compiler_ptr accessible as a global variable to Wren code;
-   it's located in the first Value cell of the_store. (See
-   primitive_dictionary, below.) This requires that
-   sizeof (unsigned char *) == sizeof (Value). Sorry!
-   (If you change Value to a short type, then change compiler_ptr to a
-   short offset from the_store instead of a pointer type.
-   */
-#define compiler_ptr ( *(unsigned char **) the_store )
-#define dictionary_ptr ( *(unsigned char **) (the_store+4))
+/* To Wren code, an address is an offset into the_store, so that it
+   fits in a Value of any width. We make compiler_ptr and
+   dictionary_ptr accessible to Wren code as the global variables cp and
+   dp, which live in the first two Value cells of the_store; they're
+   copied there before running any Wren code and back after. (See
+   export_pointers.) */
+static unsigned char *compiler_ptr;
+static unsigned char *dictionary_ptr;
+
+/* Definitions below the fence (the built-in variables, and a server's
+   shared library) can't be forgotten. */
+static unsigned char *fence = the_store;
+
+static void export_pointers (void)
+{
+	((Value *) the_store)[0] = compiler_ptr - the_store;
+	((Value *) the_store)[1] = dictionary_ptr - the_store;
+}
+
+static void forget_strings (void);
+static void relink_slots (void);
+static void print_report (void);
+static unsigned char *definition_end (const unsigned char *start);
+
+/* Take back cp and dp from Wren code, unless it's made nonsense of
+   them. */
+static void import_pointers (void)
+{
+	UValue cp = ((Value *) the_store)[0];
+	UValue dp = ((Value *) the_store)[1];
+	if ((UValue) (fence - the_store) <= cp && cp <= dp && dp <= store_capacity)
+	{
+		int shrunk = the_store + cp < compiler_ptr;
+		compiler_ptr = the_store + cp;
+		dictionary_ptr = the_store + dp;
+		forget_strings ();
+		if (indirect_calls && shrunk)
+			relink_slots ();
+	}
+	else
+	{
+		complain ("Dictionary corrupted");
+		export_pointers ();
+	}
+}
 
 static int available (unsigned amount)
 {
@@ -97,7 +270,7 @@ static const unsigned char *next_header (const unsigned char *header)
 	return h->name + h->name_length;
 }
 
-static Header *bind (const char *name, unsigned length, 
+static Header *bind_name (const char *name, unsigned length, 
 		NameKind kind, unsigned binding, unsigned arity)
 {
 	assert (name);
@@ -134,6 +307,29 @@ static const Header *lookup (const unsigned char *dict,
 	return NULL;
 }
 
+/* With indirect_calls, point the slot of each procedure in the store
+   (above the fence) at the latest one with the same name and arity. */
+static void relink_slots (void)
+{
+	const unsigned char *d, *e;
+	for (d = dictionary_ptr; d < store_end; d = next_header (d))
+	{
+		const Header *h = (const Header *) d;
+		if (h->kind != a_procedure || the_store + h->binding < fence)
+			continue;
+		for (e = dictionary_ptr; e < d; e = next_header (e))
+		{
+			const Header *g = (const Header *) e;
+			if (g->kind == a_procedure && g->arity == h->arity
+					&& g->name_length == h->name_length
+					&& 0 == memcmp (g->name, h->name, h->name_length))
+				break;
+		}
+		*(unsigned short *)(the_store + h->binding - sizeof (unsigned short)) =
+			((const Header *) e)->binding;
+	}
+}
+
 #ifndef NDEBUG
 #if 0
 static void dump (const unsigned char *dict, 
@@ -167,7 +363,13 @@ enum {
 	GETC, PUTC,
 	FETCH_BYTE, PEEK, POKE,
 	LOCAL_FETCH_0, LOCAL_FETCH_1, PUSHW, PUSHB,
-
+	LOOP, SPAWN, YIELD,
+	TRACE, TRACE_DUMP, MEMO_FETCH, MEMO_STORE,
+	REPORT, STACK_HWM, CODE_SIZE,
+	TABLESWITCH, LOOKUPSWITCH,
+	FILE_MAP, FILE_LENGTH, FILE_UNMAP,
+	PMAP, READ_BLOCK, READ_LINE,
+	STRING_REF,
 };
 
 #ifndef NDEBUG
@@ -183,6 +385,13 @@ static const char *opcode_names[] = {
 	"GETC", "PUTC",
 	"FETCH_BYTE", "PEEK", "POKE",
 	"LOCAL_FETCH_0", "LOCAL_FETCH_1", "PUSHW", "PUSHB",
+	"LOOP", "SPAWN", "YIELD",
+	"TRACE", "TRACE_DUMP", "MEMO_FETCH", "MEMO_STORE",
+	"REPORT", "STACK_HWM", "CODE_SIZE",
+	"TABLESWITCH", "LOOKUPSWITCH",
+	"FILE_MAP", "FILE_LENGTH", "FILE_UNMAP",
+	"PMAP", "READ_BLOCK", "READ_LINE",
+	"STRING_REF",
 };
 #endif
 
@@ -199,8 +408,96 @@ static const unsigned char primitive_dictionary[] =
 	PRIM_HEADER(PUTC, 1, 4), 'p', 'u', 't', 'c',
 	PRIM_HEADER(PEEK, 1, 4), 'p', 'e', 'e', 'k',
 	PRIM_HEADER(POKE, 2, 4), 'p', 'o', 'k', 'e',
+	PRIM_HEADER(SPAWN, 1, 5), 's', 'p', 'a', 'w', 'n',
+	PRIM_HEADER(YIELD, 0, 5), 'y', 'i', 'e', 'l', 'd',
+	PRIM_HEADER(TRACE, 1, 5), 't', 'r', 'a', 'c', 'e',
+	PRIM_HEADER(TRACE_DUMP, 0, 9), 't', 'r', 'a', 'c', 'e', 'd', 'u', 'm', 'p',
+	PRIM_HEADER(REPORT, 0, 6), 'r', 'e', 'p', 'o', 'r', 't',
+	PRIM_HEADER(STACK_HWM, 0, 8), 's', 't', 'a', 'c', 'k', 'h', 'w', 'm',
+	PRIM_HEADER(CODE_SIZE, 1, 8), 'c', 'o', 'd', 'e', 's', 'i', 'z', 'e',
+	PRIM_HEADER(FILE_MAP, 2, 7), 'm', 'a', 'p', 'f', 'i', 'l', 'e',
+	PRIM_HEADER(FILE_LENGTH, 1, 9), 'm', 'a', 'p', 'l', 'e', 'n', 'g', 't', 'h',
+	PRIM_HEADER(FILE_UNMAP, 1, 5), 'u', 'n', 'm', 'a', 'p',
+	PRIM_HEADER(PMAP, 4, 4), 'p', 'm', 'a', 'p',
+	PRIM_HEADER(READ_BLOCK, 2, 4), 'r', 'e', 'a', 'd',
+	PRIM_HEADER(READ_LINE, 2, 8), 'r', 'e', 'a', 'd', 'l', 'i', 'n', 'e',
 };
 
+/* The preloaded library in ROM
+
+   Building with -DROM='"rom.h"' links in a library precompiled by
+   'wren -r library >rom.h' (see dump_rom, below). Its code and
+   dictionary stay in the const arrays there, costing no RAM; only its
+   global variables get cells in the store, at startup. A code address
+   with rom_flag set means an offset into rom_code, not the_store. */
+
+enum { rom_flag = 0x2000 };
+
+#ifdef ROM
+#include ROM
+#else
+enum { rom_code_size = 0, rom_dictionary_size = 0, rom_globals_count = 0 };
+static const Instruc rom_code[1];
+static const unsigned char rom_dictionary[1];
+static const Value rom_globals[1];
+#endif
+
+static Instruc *code_address (unsigned short offset)
+{
+	if (rom_code_size && (offset & rom_flag))
+		return (Instruc *) rom_code + (offset & ~rom_flag);
+	return the_store + offset;
+}
+
+static unsigned short code_offset (const Instruc *pc)
+{
+	if (rom_code_size && rom_code <= pc && pc < rom_code + rom_code_size)
+		return (pc - rom_code) | rom_flag;
+	return pc - the_store;
+}
+
+/* Where a call to the procedure at 'offset' goes: there, or with
+   indirect_calls, wherever the slot just before it says. */
+static Instruc *callee (unsigned short offset)
+{
+	Instruc *entry = code_address (offset);
+	if (indirect_calls)
+		return code_address (*(unsigned short *)(entry - sizeof offset));
+	return entry;
+}
+
+/* Find what 'name' means: the latest definition in the store, else
+   in ROM, else a primitive. */
+static const Header *lookup_name (const char *name, unsigned length)
+{
+	const Header *h = lookup (dictionary_ptr, store_end, name, length);
+	if (!h && rom_dictionary_size)
+		h = lookup (rom_dictionary, rom_dictionary + rom_dictionary_size,
+				name, length);
+	if (!h)
+		h = lookup (primitive_dictionary, 
+				primitive_dictionary + sizeof primitive_dictionary,
+				name, length);
+	return h;
+}
+
+/* The header of the procedure whose code is at Wren address 'a', or
+   NULL. */
+static const Header *procedure_at (Value a)
+{
+	const unsigned char *d;
+	for (d = dictionary_ptr; d < store_end; d = next_header (d))
+		if (((const Header *) d)->kind == a_procedure 
+				&& ((const Header *) d)->binding == (UValue) a)
+			return (const Header *) d;
+	for (d = rom_dictionary; d < rom_dictionary + rom_dictionary_size; 
+			d = next_header (d))
+		if (((const Header *) d)->kind == a_procedure 
+				&& ((const Header *) d)->binding == (UValue) a)
+			return (const Header *) d;
+	return NULL;
+}
+
 #ifndef NDEBUG
 #if 0
 static void dump_dictionary (void)
@@ -213,19 +510,406 @@ static void dump_dictionary (void)
 #endif
 #endif
 
-/* Run VM code starting at 'pc', with the stack allocated the space between
-   'end' and dictionary_ptr. Return the result on top of the stack. */
-static Value run (Instruc *pc, const Instruc *end)
+/* Return the address of the instruction following the one at 'pc'. */
+static Instruc *next_instruc (Instruc *pc)
+{
+	switch (*pc)
+	{
+		case PUSH:
+			return pc + 1 + sizeof (Value);
+		case PUSH_STRING:
+			return pc + 1 + strlen ((const char *)pc + 1) + 1;
+		case STRING_REF: case GLOBAL_FETCH: case GLOBAL_STORE:
+		case BRANCH: case JUMP: case PUSHW:
+			return pc + 1 + sizeof (unsigned short);
+		case LOCAL_FETCH: case PUSHB:
+			return pc + 2;
+		case TCALL: case CALL: case LOOP:
+		case MEMO_FETCH: case MEMO_STORE:
+			return pc + 2 + sizeof (unsigned short);
+		case TABLESWITCH:
+			return pc + 1 + sizeof (Value) + sizeof (unsigned short)
+				+ *(unsigned short *)(pc + 1 + sizeof (Value)) * sizeof (short);
+		case LOOKUPSWITCH:
+			return pc + 1 + sizeof (unsigned short)
+				+ *(unsigned short *)(pc + 1) * (sizeof (Value) + sizeof (short));
+		default:
+			return pc + 1;
+	}
+}
+
+/* Follow any chain of JUMPs starting at 'cont'; we land on whatever
+   will really execute next. */
+static const Instruc *skip_jumps (const Instruc *cont)
+{
+	while (*cont == JUMP)
+	{
+		++cont;
+		cont += *(unsigned short *)cont;
+	}
+	return cont;
+}
+
+/* Number of Values a stack frame's saved bp and return address take. */
+enum { 
+	frame_cells = (2 * sizeof (unsigned short) + sizeof (Value) - 1) 
+		/ sizeof (Value)
+};
+
+/* Memory-mapped files
+
+   'mapfile' maps a whole file into memory outside the store, and
+   returns the Wren address of its first byte. Mapping i has the
+   addresses from (i+1) * map_window up, so it takes a Value of at
+   least 32 bits to reach them. */
+
+enum { map_window = 1 << 26 };
+
+typedef struct Mapping Mapping;
+struct Mapping {
+	unsigned char *bytes;
+	size_t length;
+	unsigned char used, writable;
+};
+
+static Mapping mappings[max_mappings];
+
+/* Return the mapping that Wren address 'a' falls in the window of,
+   or NULL. */
+static Mapping *mapping (UValue a)
+{
+	UValue i = a / map_window;
+	if (0 < i && i <= max_mappings && mappings[i-1].used)
+		return &mappings[i-1];
+	return NULL;
+}
+
+/* Return the address of a new mapping of the file named 'name', or 0. */
+static Value map_file (const char *name, int writable)
+{
+	unsigned i;
+	int fd;
+	struct stat st;
+	void *bytes = NULL;
+	if (sizeof (Value) < 4)
+	{
+		complain ("Values too narrow to map files");
+		return 0;
+	}
+	for (i = 0; i < max_mappings && mappings[i].used; ++i)
+		;
+	if (i == max_mappings)
+	{
+		complain ("Too many files mapped");
+		return 0;
+	}
+	fd = open (name, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat (fd, &st) < 0 || map_window < st.st_size)
+	{
+		close (fd);
+		return 0;
+	}
+	if (0 < st.st_size)
+		bytes = mmap (NULL, st.st_size, 
+				writable ? PROT_READ | PROT_WRITE : PROT_READ, 
+				MAP_SHARED, fd, 0);
+	close (fd);
+	if (bytes == MAP_FAILED)
+		return 0;
+	mappings[i].bytes = bytes;
+	mappings[i].length = st.st_size;
+	mappings[i].used = 1;
+	mappings[i].writable = writable != 0;
+	return (Value) (i + 1) * map_window;
+}
+
+/* Where the Wren address 'a' points, if the 'size' bytes from there
+   are all in the store, the code in ROM, or a mapped file (one that's
+   writable, if 'writing'); else NULL. */
+static unsigned char *address (Value a, unsigned size, int writing)
+{
+	UValue u = a;
+	Mapping *m;
+	if (u < store_capacity)
+		return u + size <= store_capacity ? the_store + u : NULL;
+	if ((m = mapping (u)))
+	{
+		u %= map_window;
+		return u + size <= m->length && (m->writable || !writing)
+			? m->bytes + u : NULL;
+	}
+	if (rom_code_size && (u & rom_flag))
+	{
+		u &= ~rom_flag;
+		return !writing && u + size <= rom_code_size 
+			? (unsigned char *) rom_code + u : NULL;
+	}
+	return NULL;
+}
+
+/* Where scratch_expr has put the code it's running */
+static const unsigned char *scratch_start, *scratch_end;
+
+/* Return the address of the n bytes at Wren address 'a' if Wren code
+   may fill them in bulk, else NULL. That's in a writable mapping, or
+   in the store above the built-in variables and below cp: not in the
+   free space the stacks are in, or the dictionary, or the scratch code
+   being run. cp is read from its cell, since that code may have moved
+   it. */
+static unsigned char *buffer (Value a, uint64_t size)
+{
+	unsigned char *p = map_window < size ? NULL : address (a, size, 1);
+	UValue cp = ((Value *) the_store)[0];
+	if (p && the_store <= p && p < store_end
+			&& (p < the_store + 4*sizeof (Value)
+				|| cp < (UValue) (p + size - the_store)
+				|| dictionary_ptr < p + size
+				|| (p < scratch_end && scratch_start < p + size)))
+		return NULL;
+	return p;
+}
+
+/* Return the length of the '\0'-ended string at 'a', or -1 if it
+   runs out of bounds. */
+static int string_length (Value a)
+{
+	const unsigned char *s = address (a, 1, 0);
+	int n = 0;
+	for (; s; s = address (a + ++n, 1, 0))
+		if (*s == '\0')
+			return n;
+	return -1;
+}
+
+/* Find where a call with the 'n' arguments ending at 'bp' belongs in
+   the memo table whose store offset is at 'operand'. */
+static Value *memo_entry (const Value *bp, unsigned n, const Instruc *operand)
+{
+	Value *table = (Value *)(the_store + *(unsigned short *)operand);
+	unsigned hash = 0;
+	int i;
+	for (i = 0; i < (int) n; ++i)
+		hash = 31 * hash + bp[-i];
+	return table + (hash & (memo_slots - 1)) * (n + 2);
+}
+
+/* Tasks
+
+   A task is a thread of Wren code with its own stack, interleaved with
+   the others inside one call of run(). The main task is the one run()
+   was asked to evaluate; 'spawn' starts another at the entry of a
+   procedure of no arguments, which ends when that procedure returns.
+   Tasks switch round-robin when one calls 'yield' or uses up its
+   time_slice. The registers pc, sp and bp are all there is to save.
+
+   The stack of a spawned task is carved out of the bottom of the space
+   that the main task's stack grows down into, and kept for reuse by
+   later tasks until run() returns. (Or with vm_stack_size, each task
+   has its own, from vm_stacks.) */
+
+typedef struct Task Task;
+struct Task {
+	Instruc *pc;
+	Value *sp, *bp;
+	const unsigned char *end;	/* The bottom of this task's stack */
+	unsigned char live;
+};
+
+static size_t stack_hwm = 0;	/* Most bytes of stack any run() used */
+static size_t stack_high_water (void);
+static unsigned highest_task = 0;	/* Of those ever spawned */
+
+static volatile sig_atomic_t interrupted = 0;
+
+/* The stacks outside the store
+
+   With vm_stack_size set, main() maps max_tasks stacks of vm_stack_bytes
+   each, every one just above a guard page that can't be touched. A
+   stack overflow faults on a guard page, and the handler (on a stack
+   of its own) jumps back into run() to complain. */
+
+static unsigned char *vm_stacks;
+static size_t vm_guard_bytes, vm_stack_bytes;
+static __thread sigjmp_buf stack_overflow_jump;
+static __thread unsigned char *worker_guard = NULL;	/* See pmap() */
+
+static unsigned char *vm_stack (unsigned t)
+{
+	return vm_stacks + t * (vm_guard_bytes + vm_stack_bytes) + vm_guard_bytes;
+}
+
+static void segv_handler (int sig, siginfo_t *info, void *context)
+{
+	unsigned char *a = info->si_addr;
+	size_t stride = vm_guard_bytes + vm_stack_bytes;
+	(void) context;
+	if (vm_stacks <= a && a < vm_stacks + max_tasks * stride 
+			&& (size_t) (a - vm_stacks) % stride < vm_guard_bytes)
+		siglongjmp (stack_overflow_jump, 1);
+	if (worker_guard && worker_guard <= a && a < worker_guard + vm_guard_bytes)
+		siglongjmp (stack_overflow_jump, 1);
+	signal (sig, SIG_DFL);  /* Some other crash: let it happen. */
+}
+
+static int map_vm_stacks (void)
+{
+	static unsigned char signal_stack[65536];
+	stack_t ss;
+	struct sigaction sa;
+	unsigned t;
+	vm_guard_bytes = sysconf (_SC_PAGESIZE);
+	vm_stack_bytes = (vm_stack_size + vm_guard_bytes - 1) 
+		& ~(vm_guard_bytes - 1);
+	vm_stacks = mmap (NULL, max_tasks * (vm_guard_bytes + vm_stack_bytes),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (vm_stacks == MAP_FAILED)
+		return 0;
+	for (t = 0; t < max_tasks; ++t)
+		if (mprotect (vm_stack (t) - vm_guard_bytes, vm_guard_bytes, 
+					PROT_NONE) < 0)
+			return 0;
+	ss.ss_sp = signal_stack;
+	ss.ss_size = sizeof signal_stack;
+	ss.ss_flags = 0;
+	memset (&sa, 0, sizeof sa);
+	sa.sa_sigaction = segv_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset (&sa.sa_mask);
+	return sigaltstack (&ss, NULL) == 0 && sigaction (SIGSEGV, &sa, NULL) == 0;
+}
+
+static void interrupt_handler (int sig)
+{
+	(void) sig;
+	interrupted = 1;
+}
+
+/* Execution trace
+
+   'trace 1' starts recording each instruction run into a ring buffer
+   of the last trace_size, and 'trace 0' stops it. The buffer is
+   printed to stderr by 'tracedump', when run() fails while tracing, or
+   on a SIGUSR1 (at the next instruction traced). Unlike 'loud', it
+   costs nothing per instruction while off: see execute(). */
+
+typedef struct Trace Trace;
+struct Trace {
+	unsigned short pc;	/* As a code_offset */
+	Instruc opcode;
+	unsigned short depth;	/* Number of Values on the task's stack */
+	Value top;	/* The topmost of them, as of before the instruction */
+};
+
+static Trace trace_ring[trace_size];
+static unsigned trace_count = 0;
+static int tracing = 0;
+static volatile sig_atomic_t trace_wanted = 0;
+
+static void trace_handler (int sig)
+{
+	(void) sig;
+	trace_wanted = 1;
+}
+
+/* Print where 'pc' is, as a procedure name and offset if we can. */
+static void print_code_offset (FILE *f, unsigned short pc)
+{
+	const Header *best = NULL;
+	const unsigned char *d = dictionary_ptr, *end = store_end;
+	int pass;
+	if (pc < compiler_ptr - the_store || (pc & rom_flag))
+		for (pass = 0; pass < 2; ++pass)
+		{
+			for (; d < end; d = next_header (d))
+			{
+				const Header *h = (const Header *) d;
+				if (h->kind != a_local && h->kind != a_primitive
+						&& h->binding <= pc 
+						&& (h->binding & rom_flag) == (pc & rom_flag)
+						&& (!best || best->binding < h->binding))
+					best = h;
+			}
+			d = rom_dictionary;
+			end = rom_dictionary + rom_dictionary_size;
+		}
+	if (best && best->kind == a_procedure)
+		fprintf (f, "%.*s+%u", best->name_length, best->name, 
+				pc - best->binding);
+	else
+		fprintf (f, "%u", pc);
+}
+
+static void dump_trace (void)
+{
+	unsigned i = trace_count < trace_size ? 0 : trace_count - trace_size;
+	fprintf (stderr, "Last %u instructions traced:\n", trace_count - i);
+	for (; i < trace_count; ++i)
+	{
+		const Trace *t = &trace_ring[i % trace_size];
+		fputs ("  ", stderr);
+		print_code_offset (stderr, t->pc);
+#ifndef NDEBUG
+		fprintf (stderr, "\t%s", opcode_names[t->opcode]);
+#else
+		fprintf (stderr, "\t%u", t->opcode);
+#endif
+		fprintf (stderr, "\tdepth %u", t->depth);
+		if (t->depth)
+			fprintf (stderr, "\ttop %" PRIdValue, t->top);
+		fputc ('\n', stderr);
+	}
+	trace_wanted = 0;
+}
+
+static __thread int in_worker = 0;	/* True in a thread of pmap()'s */
+static pthread_mutex_t memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pmap (Value f, Value lo, Value hi, Value dest, const Instruc *halt);
+
+/* The interpreter
+
+   execute() is the loop that runs the code. It's inlined twice into
+   run(), once with tracing on and once off, so that while it's off the
+   trace costs nothing per instruction. Switching with 'trace' leaves
+   one copy with the whole state of the run in a Machine and picks it up
+   in the other. */
+
+typedef struct Machine Machine;
+struct Machine {
+	Instruc *pc;
+	Value *sp, *bp, *top, *main_top;
+	const unsigned char *end;
+	Task tasks[max_tasks];
+	unsigned current, live_tasks;
+	Value result;
+	int budget;
+};
+
+enum { run_done, run_failed, run_retrace };
+
+static int execute (Machine *m, const Instruc *halt, const int traced)
+	__attribute__((always_inline));  /* XXX gcc dependency */
+static inline int execute (Machine *m, const Instruc *halt, const int traced)
 {
-	/* Stack pointer and base pointer 
-	   Initially just above the first free aligned Value cell below
-	   the dictionary. */
-	Value *sp = (Value *) (((unsigned)dictionary_ptr) & ~(sizeof (Value) - 1));
-	Value *bp = sp;
+	/* Kept local so they can live in registers */
+	Instruc *pc = m->pc;
+	Value *sp = m->sp, *bp = m->bp;
+	Value *const main_top = m->main_top;
+	Value *top = m->top;	/* The top of the current task's stack */
+	const unsigned char *end = m->end;
+
+	const size_t stack_bytes = vm_stack_size ? vm_stack_bytes : task_stack_size;
+	Task *const tasks = m->tasks;
+	unsigned current = m->current, live_tasks = m->live_tasks;
+	Value result = m->result;
+	int budget = m->budget;
 
 #define need(n)                                        \
 	do {                                                 \
-		if ((unsigned char *)sp - (n)*sizeof(Value) < end) \
+		if (!vm_stack_size                                 \
+				&& (unsigned char *)sp - (n)*sizeof(Value) < end) \
 		goto stack_overflow;                             \
 	} while (0)
 
@@ -233,14 +917,40 @@ static Value run (Instruc *pc, const Instruc *end)
 	{
 #ifndef NDEBUG
 		if (loud)
-			printf ("RUN: %u\t%s\n", pc - the_store, opcode_names[*pc]);
+			printf ("RUN: %u\t%s\n", code_offset (pc), opcode_names[*pc]);
 #endif
+		if (traced)
+		{
+			Trace *t = &trace_ring[trace_count++ % trace_size];
+			t->pc = code_offset (pc);
+			t->opcode = *pc;
+			t->depth = top - sp;
+			/* Just above an empty stack may be a guard page. */
+			t->top = t->depth ? sp[0] : 0;
+			if (trace_wanted)
+				dump_trace ();
+		}
+		if (time_slice && --budget == 0)
+		{
+			budget = time_slice;
+			if (interrupted)
+				goto interrupt;
+			if (1 < live_tasks)
+				goto switch_task;
+		}
 
 		switch (*pc++)
 		{
 			case HALT:
-				return sp[0];
-				break;
+				if (current == 0)
+					result = sp[0];
+				tasks[current].live = 0;
+				if (--live_tasks == 0)
+				{
+					m->result = result;
+					return run_done;
+				}
+				goto next_task;
 
 			case PUSH: 
 				need (1);
@@ -263,10 +973,15 @@ static Value run (Instruc *pc, const Instruc *end)
 
 			case PUSH_STRING:
 				need (1);
-				*--sp = (Value)pc;
+				*--sp = code_offset (pc);
 				/* N.B. this op is slower the longer the string is! */
 				pc += strlen ((const char *)pc) + 1;
 				break;
+			case STRING_REF:
+				need (1);
+				*--sp = *(unsigned short *)pc;
+				pc += sizeof (unsigned short);
+				break;
 
 			case GLOBAL_FETCH:
 				need (1);
@@ -297,7 +1012,10 @@ static Value run (Instruc *pc, const Instruc *end)
 				   (This is also where the return value will go.)
 				   ...
 				   bp[-(n-1)]: rightmost argument (where n is the number of arguments)
-				   bp[-n]: pair of old bp and return address (in two half-words)
+				   bp[-n]: pair of old bp and return address (in two half-words,
+				   taking up the frame_cells Values from here down; the old bp
+				   is a count of Values above the frame, so stacks needn't be
+				   in the store)
 				   ...temporaries...
 				   sp[0]: topmost temporary
 
@@ -307,21 +1025,34 @@ static Value run (Instruc *pc, const Instruc *end)
 				   32 bits wide then we don't even waste any extra space.
 
 				   By the time we return, there's only one temporary in this frame:
-				   the return value. Thus, &bp[-n] == &sp[1] at this time, and the 
-				   RETURN instruction doesn't need to know the value of n. CALL,
+				   the return value. Thus, &bp[-n] == &sp[frame_cells] at this time,
+				   and the RETURN instruction doesn't need to know the value of n. CALL,
 				   otoh, does. It looks like <CALL> <n> <addr-byte-1> <addr-byte-2>.
 				   */ 
 			case TCALL:	/* Known tail call. */
 				{
 					unsigned char n = pc[0];
-					/* XXX portability: this assumes two unsigned shorts fit in a Value */
-					Value frame_info = sp[n];
+					Value frame_info[frame_cells];
+					Value *old_frame = sp + n;
+					memcpy (frame_info, old_frame, sizeof frame_info);
 					memmove ((bp+1-n), sp, n * sizeof (Value));
-					sp = bp - n;
-					sp[0] = frame_info;
-					pc = the_store + *(unsigned short *)(pc + 1);
+					sp = bp - n - (frame_cells - 1);
+					memcpy (sp, frame_info, sizeof frame_info);
+					/* The frame moved up, nearer the old bp it points to. */
+					((unsigned short *)sp)[0] -= sp - old_frame;
+					pc = callee (*(unsigned short *)(pc + 1));
 				}
 			   	break;
+			case LOOP:	/* Known self tail call: the frame already fits. */
+				{
+					unsigned char n = pc[0];
+					unsigned char i;
+					for (i = 0; i < n; ++i)
+						bp[-i] = sp[n-1-i];
+					sp = bp - n - (frame_cells - 1);
+					pc = code_address (*(unsigned short *)(pc + 1));
+				}
+				break;
 			case CALL:
 				{
 					/* Optimize tail calls.
@@ -334,47 +1065,88 @@ static Value run (Instruc *pc, const Instruc *end)
 					   position. 
 
 					   (Maybe that expense would be worth incurring, though, for the
-					   sake of smaller compiled code.)
+					   sake of smaller compiled code.) The one exception is a
+					   procedure calling itself: run_fun makes a pass over the
+					   finished body and turns those into LOOPs.
 					   */
-					const Instruc *cont = pc + 1 + sizeof (unsigned short);
-					while (*cont == JUMP)
-					{
-						++cont;
-						cont += *(unsigned short *)cont;
-					}
+					const Instruc *cont = 
+						skip_jumps (pc + 1 + sizeof (unsigned short));
 					if (*cont == RETURN)
 					{
-						/* This is a tail call. Replace opcode and re-run */
+						/* This is a tail call. Replace opcode and re-run.
+						   (Never in ROM: dump_rom already did it there.) */
 						*--pc = TCALL;
 					}
 					else
 					{
 						/* This is a non-tail call. Build a new frame. */ 
-						need (1);
-						--sp;
+						need (frame_cells);
+						sp -= frame_cells;
 						{
-							/* XXX portability: this assumes two unsigned shorts fit in a Value */
 							unsigned short *f = (unsigned short *)sp;
-							f[0] = (unsigned char *)bp - the_store;
-							f[1] = cont - the_store;
-							bp = sp + pc[0];
+							f[0] = bp - sp;
+							f[1] = code_offset (cont);
+							bp = sp + (frame_cells - 1) + pc[0];
 						}
-						pc = the_store + *(unsigned short *)(pc + 1);
+						pc = callee (*(unsigned short *)(pc + 1));
 					}
 				}
 				break;
 
 			case RETURN:
+			do_return:
 				{
 					Value result = sp[0];
-					unsigned short *f = (unsigned short *)(sp + 1);
+					Value *frame = sp + 1;
+					unsigned short *f = (unsigned short *)frame;
 					sp = bp;
-					bp = (Value *)(the_store + f[0]);
-					pc = the_store + f[1];
+					bp = frame + f[0];
+					pc = code_address (f[1]);
 					sp[0] = result;
 				}
 				break;
 
+				/* A 'memo fun' starts with MEMO_FETCH and ends with MEMO_STORE
+				   before its RETURN. They share a table of memo_slots entries,
+				   each holding a used flag, the arguments, and the result;
+				   which entry a call goes in is a hash of its arguments. */
+			case MEMO_FETCH:
+				{
+					unsigned char n = pc[0];
+					Value *entry = memo_entry (bp, n, pc + 1);
+					Value cached;
+					int hit;
+					if (in_worker)
+						pthread_mutex_lock (&memo_lock);
+					hit = entry[0] && 0 == memcmp (entry + 1, bp - (n - 1), 
+							n * sizeof (Value));
+					cached = entry[n + 1];
+					if (in_worker)
+						pthread_mutex_unlock (&memo_lock);
+					if (hit)
+					{
+						need (1);
+						*--sp = cached;
+						goto do_return;
+					}
+					pc += 1 + sizeof (unsigned short);
+				}
+				break;
+			case MEMO_STORE:
+				{
+					unsigned char n = pc[0];
+					Value *entry = memo_entry (bp, n, pc + 1);
+					if (in_worker)
+						pthread_mutex_lock (&memo_lock);
+					entry[0] = 1;
+					memcpy (entry + 1, bp - (n - 1), n * sizeof (Value));
+					entry[n + 1] = sp[0];
+					if (in_worker)
+						pthread_mutex_unlock (&memo_lock);
+					pc += 1 + sizeof (unsigned short);
+				}
+				break;
+
 			case BRANCH:
 				if (0 == *sp++)
 					pc += *(unsigned short *)pc;
@@ -391,14 +1163,14 @@ static Value run (Instruc *pc, const Instruc *end)
 			case MUL:  sp[1] *= sp[0]; ++sp; break;
 			case DIV:  sp[1] /= sp[0]; ++sp; break;
 			case MOD:  sp[1] %= sp[0]; ++sp; break;
-			case UMUL: sp[1] = (unsigned)sp[1] * (unsigned)sp[0]; ++sp; break;
-			case UDIV: sp[1] = (unsigned)sp[1] / (unsigned)sp[0]; ++sp; break;
-			case UMOD: sp[1] = (unsigned)sp[1] % (unsigned)sp[0]; ++sp; break;
+			case UMUL: sp[1] = (UValue)sp[1] * (UValue)sp[0]; ++sp; break;
+			case UDIV: sp[1] = (UValue)sp[1] / (UValue)sp[0]; ++sp; break;
+			case UMOD: sp[1] = (UValue)sp[1] % (UValue)sp[0]; ++sp; break;
 			case NEGATE: sp[0] = -sp[0]; break;
 
 			case EQ:   sp[1] = sp[1] == sp[0]; ++sp; break;
 			case LT:   sp[1] = sp[1] < sp[0];  ++sp; break;
-			case ULT:  sp[1] = (unsigned)sp[1] < (unsigned)sp[0]; ++sp; break;
+			case ULT:  sp[1] = (UValue)sp[1] < (UValue)sp[0]; ++sp; break;
 
 			case AND:  sp[1] &= sp[0]; ++sp; break;
 			case OR:   sp[1] |= sp[0]; ++sp; break;
@@ -406,38 +1178,560 @@ static Value run (Instruc *pc, const Instruc *end)
 
 			case SLA:  sp[1] <<= sp[0]; ++sp; break;
 			case SRA:  sp[1] >>= sp[0]; ++sp; break;
-			case SRL:  sp[1] = (unsigned)sp[1] >> (unsigned)sp[0]; ++sp; break;
+			case SRL:  sp[1] = (UValue)sp[1] >> (UValue)sp[0]; ++sp; break;
 
 			case GETC:
 				   need (1);
-				   *--sp = getc (stdin);
+				   *--sp = read_char ();
 				   break;
 
+			case READ_BLOCK:
+			case READ_LINE:
+				{
+					unsigned char *p = buffer (sp[1], (UValue) sp[0]);
+					if (!p)
+						goto bad_address;
+					sp[1] = read_block (p, sp[0], pc[-1] == READ_LINE);
+					++sp;
+				}
+				break;
+
 			case PUTC:
-				   putc (sp[0], stdout);
+				   putc (sp[0], output);
 				   break;
 
 			case FETCH_BYTE:
-				   /* XXX boundschecking */
-				   sp[0] = *(unsigned char *)(sp[0]);;
-				   break;
+				{
+					const unsigned char *p = address (sp[0], 1, 0);
+					if (!p)
+						goto bad_address;
+					sp[0] = *p;
+				}
+				break;
 
 			case PEEK:
-				   sp[0] = *(Value *)(sp[0]);;
-				   break;
+				{
+					const unsigned char *p = address (sp[0], sizeof (Value), 0);
+					if (!p)
+						goto bad_address;
+					sp[0] = *(const Value *)p;
+				}
+				break;
 
 			case POKE:
-				   *(Value *)(sp[1]) = sp[0];
-				   ++sp;
-				   break;
+				{
+					unsigned char *p = address (sp[1], sizeof (Value), 1);
+					if (!p)
+						goto bad_address;
+					*(Value *)p = sp[0];
+					++sp;
+				}
+				break;
+
+			case FILE_MAP:
+				{
+					int n = string_length (sp[1]);
+					if (n < 0)
+						goto bad_address;
+					sp[1] = map_file ((const char *) address (sp[1], n, 0), 
+							sp[0] != 0);
+					++sp;
+				}
+				break;
+
+			case FILE_LENGTH:
+				{
+					Mapping *m = mapping (sp[0]);
+					sp[0] = m ? (Value) m->length : 0;
+				}
+				break;
+
+			case FILE_UNMAP:
+				{
+					Mapping *m = mapping (sp[0]);
+					if (m)
+					{
+						if (m->length)
+							munmap (m->bytes, m->length);
+						m->used = 0;
+					}
+					sp[0] = 0;
+				}
+				break;
+
+			case SPAWN:
+				{
+					const Header *h = procedure_at (sp[0]);
+					Instruc *entry;
+					unsigned t = 1;
+					if (in_worker)
+					{
+						complain ("Can't spawn within pmap");
+						return run_failed;
+					}
+					if (!h || h->arity != 0)
+					{
+						complain ("Not a procedure of no arguments");
+						return run_failed;
+					}
+					entry = callee (sp[0]);
+					while (t < max_tasks && tasks[t].live)
+						++t;
+					if (t == max_tasks)
+					{
+						complain ("Too many tasks");
+						return run_failed;
+					}
+					if (highest_task < t)
+						highest_task = t;
+					if (vm_stack_size)
+						tasks[t].end = vm_stack (t);
+					else if (!tasks[t].end)
+					{
+						/* Carve a stack from under the main task's. */
+						const unsigned char **main_end = 
+							current == 0 ? &end : &tasks[0].end;
+						Value *main_sp = current == 0 ? sp : tasks[0].sp;
+						if ((unsigned char *)(main_sp - frame_cells)
+								< *main_end + task_stack_size)
+							goto stack_overflow;
+						tasks[t].end = *main_end;
+						*main_end += task_stack_size;
+					}
+					{
+						/* Build a frame that returns into the HALT. */
+						Value *tsp = 
+							(Value *)(tasks[t].end + stack_bytes) - frame_cells;
+						unsigned short *f = (unsigned short *)tsp;
+						f[0] = 0;
+						f[1] = halt - the_store;
+						tasks[t].pc = entry;
+						tasks[t].sp = tsp;
+						tasks[t].bp = tsp + (frame_cells - 1);
+						tasks[t].live = 1;
+						++live_tasks;
+					}
+					sp[0] = t;
+				}
+				break;
+
+			case YIELD:
+				need (1);
+				*--sp = 0;
+				goto switch_task;
+
+			case TRACE:
+				{
+					int on = sp[0] != 0;
+					sp[0] = tracing;
+					tracing = on;
+					if (on != traced && !in_worker)
+					{
+						/* Carry on in the other copy of this loop. */
+						m->pc = pc;
+						m->sp = sp;
+						m->bp = bp;
+						m->top = top;
+						m->end = end;
+						m->current = current;
+						m->live_tasks = live_tasks;
+						m->result = result;
+						m->budget = budget;
+						return run_retrace;
+					}
+				}
+				break;
+
+			case TRACE_DUMP:
+				need (1);
+				dump_trace ();
+				*--sp = 0;
+				break;
+
+				/* The dispatch of a 'case': pop a key and jump by the
+				   offset (from the opcode) that goes with it, or on to the
+				   next instruction if none does. TABLESWITCH has a lowest
+				   key, a count, and an offset for each key from there up;
+				   LOOKUPSWITCH, a count of key/offset pairs, sorted. */
+			case TABLESWITCH:
+				{
+					const Instruc *op = pc - 1;
+					UValue i = (UValue) *sp++ - (UValue) *(Value *)pc;
+					unsigned short count = 
+						*(unsigned short *)(pc + sizeof (Value));
+					pc += sizeof (Value) + sizeof (unsigned short);
+					if (i < count)
+						pc = (Instruc *) op + ((short *)pc)[i];
+					else
+						pc += count * sizeof (short);
+				}
+				break;
+
+			case LOOKUPSWITCH:
+				{
+					const Instruc *op = pc - 1;
+					const size_t pair_size = sizeof (Value) + sizeof (short);
+					Value key = *sp++;
+					unsigned short count = *(unsigned short *)pc;
+					const Instruc *pairs = pc + sizeof (unsigned short);
+					unsigned lo = 0, hi = count;
+					pc += sizeof (unsigned short) + count * pair_size;
+					while (lo < hi)
+					{
+						unsigned mid = (lo + hi) / 2;
+						Value k = *(Value *)(pairs + mid * pair_size);
+						if (k < key)
+							lo = mid + 1;
+						else if (key < k)
+							hi = mid;
+						else
+						{
+							pc = (Instruc *) op + 
+								*(short *)(pairs + mid * pair_size + sizeof (Value));
+							break;
+						}
+					}
+				}
+				break;
+
+			case REPORT:
+				need (1);
+				print_report ();
+				*--sp = dictionary_ptr - compiler_ptr;
+				break;
+
+			case STACK_HWM:
+				need (1);
+				*--sp = stack_high_water ();
+				break;
+
+			case CODE_SIZE:
+				{
+					const Header *h = procedure_at (sp[0]);
+					Instruc *start, *pc;
+					if (!h)
+					{
+						complain ("Not a procedure");
+						return run_failed;
+					}
+					start = code_address (h->binding);
+					if (h->binding & rom_flag)
+					{
+						/* ROM code ends with its only RETURN. */
+						for (pc = start; *pc != RETURN; pc = next_instruc (pc))
+							;
+						sp[0] = pc + 1 - start;
+					}
+					else
+						sp[0] = definition_end (start) - start;
+				}
+				break;
+
+			case PMAP:
+				if (!pmap (sp[3], sp[2], sp[1], sp[0], halt))
+					return run_failed;
+				sp += 3;
+				sp[0] = 0;
+				break;
 
 			default: assert (0);
 		}
+		continue;
+
+	switch_task:
+		tasks[current].pc = pc;
+		tasks[current].sp = sp;
+		tasks[current].bp = bp;
+		tasks[current].end = end;
+	next_task:
+		do
+			current = (current + 1) % max_tasks;
+		while (!tasks[current].live);
+		pc = tasks[current].pc;
+		sp = tasks[current].sp;
+		bp = tasks[current].bp;
+		end = tasks[current].end;
+		top = current ? (Value *)(end + stack_bytes) : main_top;
+		budget = time_slice;
 	}
 
 stack_overflow:
 	complain ("Stack overflow");
-	return 0;
+	return run_failed;
+
+bad_address:
+	complain ("Bad address");
+	return run_failed;
+
+interrupt:
+	interrupted = 0;
+	complain ("Interrupted");
+	return run_failed;
+}
+
+/* Run VM code starting at 'pc', with the stack pointer and base pointer
+   'sp' and 'bp', and the stack allocated the space between 'end' (aligned)
+   and sp. The code must finish with the HALT at 'halt'. Return the result
+   on top of the stack once every task has finished. */
+static Value run (Instruc *pc, const Instruc *halt, const unsigned char *end,
+		Value *sp, Value *bp)
+{
+	Machine m;
+	int status;
+	memset (&m, 0, sizeof m);
+	m.pc = pc;
+	m.sp = sp;
+	m.bp = m.main_top = m.top = bp;
+	m.end = end;
+	m.tasks[0].live = 1;
+	m.live_tasks = 1;
+	m.budget = time_slice;
+	do
+		status = tracing && !in_worker 
+			? execute (&m, halt, 1) : execute (&m, halt, 0);
+	while (status == run_retrace);
+	return status == run_done ? m.result : 0;
+}
+
+/* Stack high-water mark
+
+   Before run(), the free store is painted with a byte that stacks
+   seldom leave; afterward, the lowest byte that isn't paint shows
+   how deep they went, spawned tasks' stacks included. The stacks
+   outside the store start out zeroed and nothing else uses them, so
+   the deepest any run went stays there to be found: we look only
+   when someone asks, rather than scanning all of them after every
+   run. */
+
+enum { stack_paint = 0xa5 };
+
+/* Return the bytes used at the top of [bottom, top), both aligned. */
+static size_t stack_used (unsigned char *bottom, unsigned char *top, 
+		unsigned char paint)
+{
+	Value painted, *p = (Value *) bottom;
+	memset (&painted, paint, sizeof painted);
+	while (p < (Value *) top && *p == painted)
+		++p;
+	return top - (unsigned char *) p;
+}
+
+/* Like run(), but catch a stack overflow that hits a guard page, and
+   keep track of stack_hwm for a stack in the store. The stack gets the space between 'end' and
+   'ceiling' (or all of vm_stack (0)). */
+static Value run_guarded (Instruc *pc, const Instruc *halt, 
+		const unsigned char *end, const unsigned char *ceiling)
+{
+	/* The stack starts just above the first free aligned Value cell
+	   below the ceiling. */
+	unsigned char *bottom = the_store + 
+		((end - the_store + sizeof (Value) - 1) & ~(sizeof (Value) - 1));
+	unsigned char *top = the_store + 
+		((ceiling - the_store) & ~(sizeof (Value) - 1));
+	Value *sp = vm_stack_size 
+		? (Value *) (vm_stack (0) + vm_stack_bytes) : (Value *) top;
+	Value result;
+	interrupted = 0;
+	if (vm_stack_size)
+	{
+		if (sigsetjmp (stack_overflow_jump, 1))
+		{
+			complain ("Stack overflow");
+			return 0;
+		}
+		return run (pc, halt, vm_stack (0), sp, sp);
+	}
+	if (bottom < top)
+		memset (bottom, stack_paint, top - bottom);
+	result = run (pc, halt, bottom, sp, sp);
+	{
+		/* What the run allotted by moving cp up isn't stack. */
+		UValue cp = ((Value *) the_store)[0];
+		if (bottom < the_store + cp && cp < (UValue) (top - the_store))
+			bottom = the_store + 
+				((cp + sizeof (Value) - 1) & ~(sizeof (Value) - 1));
+	}
+	if (bottom < top)
+	{
+		size_t used = stack_used (bottom, top, stack_paint);
+		if (stack_hwm < used)
+			stack_hwm = used;
+	}
+	return result;
+}
+
+/* Return stack_hwm, first bringing it up to date with the stacks
+   outside the store, if we're using them. */
+static size_t stack_high_water (void)
+{
+	unsigned t;
+	if (vm_stack_size)
+		for (t = 0; t <= highest_task; ++t)
+		{
+			size_t used = stack_used (vm_stack (t), 
+					vm_stack (t) + vm_stack_bytes, 0);
+			if (stack_hwm < used)
+				stack_hwm = used;
+		}
+	return stack_hwm;
+}
+
+/* Parallel map
+
+   'pmap f lo hi dest' stores f i, for each i from lo up to but not
+   including hi, in the Value cell at dest + (i - lo) * the cell size,
+   splitting the range among up to max_workers threads. Each runs
+   run() on a stack of its own outside the store, above a guard page,
+   against the same code and globals. So f should compute its result
+   from its argument, reading but not writing the store (the memo
+   tables excepted: they take a lock); it can't spawn, or pmap again.
+   No code may be patched while they run, so the tail calls that CALL
+   would turn into TCALLs get turned now. */
+
+typedef struct Worker Worker;
+struct Worker {
+	pthread_t thread;
+	Instruc *entry;
+	const Instruc *halt;
+	Value lo, hi;
+	unsigned char *dest;	/* Where f lo goes */
+	unsigned char *stack;	/* A guard page, then worker_bytes of stack */
+	const char *complaint;
+};
+
+static size_t worker_bytes, page_bytes;
+
+/* Patch every CALL in tail position in the store into a TCALL. */
+static void settle_tail_calls (void)
+{
+	const unsigned char *d;
+	for (d = dictionary_ptr; d < store_end; d = next_header (d))
+	{
+		const Header *h = (const Header *) d;
+		Instruc *pc;
+		if (h->kind != a_procedure)
+			continue;
+		/* Each procedure ends with its only RETURN. */
+		for (pc = the_store + h->binding; *pc != RETURN; pc = next_instruc (pc))
+			if (*pc == CALL 
+					&& *skip_jumps (pc + 2 + sizeof (unsigned short)) == RETURN)
+				*pc = TCALL;
+	}
+}
+
+/* Call f on each of the worker's share of the range, each time in a
+   frame that returns into the HALT. */
+static void work_range (Worker *w)
+{
+	unsigned char *bottom = w->stack + page_bytes;
+	Value *top = (Value *) (bottom + worker_bytes);
+	Value i;
+	for (i = w->lo; i < w->hi && !complaint; ++i)
+	{
+		Value *sp = top - 1 - frame_cells;
+		unsigned short *f = (unsigned short *) sp;
+		Value v;
+		top[-1] = i;
+		f[0] = 0;
+		f[1] = w->halt - the_store;
+		v = run (w->entry, w->halt, bottom, sp, top - 1);
+		memcpy (w->dest + (i - w->lo) * sizeof (Value), &v, sizeof v);
+	}
+}
+
+static void *work (void *arg)
+{
+	Worker *w = arg;
+	unsigned char signal_stack[65536];
+	in_worker = 1;
+	if (vm_stack_size)
+	{
+		stack_t ss;
+		ss.ss_sp = signal_stack;
+		ss.ss_size = sizeof signal_stack;
+		ss.ss_flags = 0;
+		worker_guard = w->stack;
+		if (sigaltstack (&ss, NULL) < 0)
+			complain ("Can't start a pmap worker");
+		else if (sigsetjmp (stack_overflow_jump, 1))
+			complain ("Stack overflow");
+	}
+	if (!complaint)
+		work_range (w);
+	w->complaint = complaint;
+	return NULL;
+}
+
+/* Do a 'pmap' called from the scratch code ending in 'halt', and
+   return true, or complain and return false. */
+static int pmap (Value f, Value lo, Value hi, Value dest, const Instruc *halt)
+{
+	Worker workers[max_workers];
+	const Header *h = procedure_at (f);
+	uint64_t count = lo < hi ? (UValue) hi - (UValue) lo : 0;
+	unsigned char *dest_bytes, *stacks;
+	long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	unsigned n = max_workers, started, i;
+
+	if (in_worker)
+	{
+		complain ("Can't pmap within pmap");
+		return 0;
+	}
+	if (!h || h->arity != 1)
+	{
+		complain ("Not a procedure of one argument");
+		return 0;
+	}
+	if (count == 0)
+		return 1;
+	if (!(dest_bytes = buffer (dest, count * sizeof (Value))))
+	{
+		complain ("Bad address");
+		return 0;
+	}
+	if (0 < cpus && cpus < (long) n)
+		n = cpus;
+	if (count < n)
+		n = count;
+
+	page_bytes = sysconf (_SC_PAGESIZE);
+	worker_bytes = vm_stack_size ? vm_stack_bytes
+		: (worker_stack_size + page_bytes - 1) & ~(page_bytes - 1);
+	stacks = mmap (NULL, n * (page_bytes + worker_bytes), 
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (stacks == MAP_FAILED)
+	{
+		complain ("Can't map the pmap stacks");
+		return 0;
+	}
+	settle_tail_calls ();
+
+	for (started = 0; started < n; ++started)
+	{
+		Worker *w = &workers[started];
+		w->entry = callee (f);
+		w->halt = halt;
+		w->lo = lo + (Value) (count * started / n);
+		w->hi = lo + (Value) (count * (started + 1) / n);
+		w->dest = dest_bytes + (w->lo - lo) * sizeof (Value);
+		w->stack = stacks + started * (page_bytes + worker_bytes);
+		w->complaint = NULL;
+		if (mprotect (w->stack, page_bytes, PROT_NONE) < 0
+				|| pthread_create (&w->thread, NULL, work, w) != 0)
+		{
+			complain ("Can't start a pmap worker");
+			break;
+		}
+	}
+	for (i = 0; i < started; ++i)
+	{
+		pthread_join (workers[i].thread, NULL);
+		if (workers[i].complaint)
+			complain (workers[i].complaint);
+	}
+	munmap (stacks, n * (page_bytes + worker_bytes));
+	return !complaint;
 }
 
 
@@ -449,7 +1743,8 @@ static void gen (Instruc opcode)
 {
 #ifndef NDEBUG
 	if (loud)
-		printf ("ASM: %u\t%s\n", compiler_ptr - the_store, opcode_names[opcode]);
+		printf ("ASM: %u\t%s\n", (unsigned) (compiler_ptr - the_store), 
+				opcode_names[opcode]);
 #endif
 	if (available (1))
 	{
@@ -461,7 +1756,7 @@ static void gen (Instruc opcode)
 static void gen_ubyte (unsigned char b)
 {
 	if (loud)
-		printf ("ASM: %u\tubyte %u\n", compiler_ptr - the_store, b);
+		printf ("ASM: %u\tubyte %u\n", (unsigned) (compiler_ptr - the_store), b);
 	if (available (1))
 		*compiler_ptr++ = b;
 }
@@ -469,7 +1764,7 @@ static void gen_ubyte (unsigned char b)
 static void gen_ushort (unsigned short u)
 {
 	if (loud)
-		printf ("ASM: %u\tushort %u\n", compiler_ptr - the_store, u);
+		printf ("ASM: %u\tushort %u\n", (unsigned) (compiler_ptr - the_store), u);
 	if (available (sizeof u))
 	{
 		*(unsigned short *)compiler_ptr = u;
@@ -480,7 +1775,8 @@ static void gen_ushort (unsigned short u)
 static void gen_value (Value v)
 {
 	if (loud)
-		printf ("ASM: %u\tvalue %d\n", compiler_ptr - the_store, v);
+		printf ("ASM: %u\tvalue %" PRIdValue "\n", 
+				(unsigned) (compiler_ptr - the_store), v);
 	if (available (sizeof v))
 	{
 		*(Value *)compiler_ptr = v;
@@ -488,23 +1784,170 @@ static void gen_value (Value v)
 	}
 }
 
-static Instruc *forward_ref (void)
+static Instruc *forward_ref (void)
+{
+	Instruc *ref = compiler_ptr;
+	compiler_ptr += sizeof (unsigned short);
+	return ref;
+}
+
+static void resolve (Instruc *ref)
+{
+	if (loud)
+		printf ("ASM: %u\tresolved: %u\n", (unsigned) (ref - the_store), 
+				(unsigned) (compiler_ptr - ref));
+	*(unsigned short *)ref = compiler_ptr - ref;
+}
+
+static void block_prev (void)
+{
+	prev_instruc = NULL;	// The previous instruction isn't really known
+}
+
+/* String literals
+
+   The first use of a literal goes inline, after a PUSH_STRING, and its
+   address goes in a pool of those in the store; a later use of the
+   same string, or of the tail of one, is a STRING_REF to those bytes.
+   So a literal used once costs what it always did, and each repeat
+   just 3 bytes. A scratch expression's literals leave the pool along
+   with its code. (Literals in ROM aren't pooled; RAM code gets its
+   own copies.) */
+
+static unsigned short strings[max_strings];	/* The pool, oldest first */
+static unsigned string_count = 0;
+
+/* Drop the literals at or above compiler_ptr, which are forgotten. */
+static void forget_strings (void)
+{
+	while (string_count && the_store + strings[string_count-1] >= compiler_ptr)
+		--string_count;
+}
+
+/* Return the offset of 's' as the tail of the string at 't', or -1. */
+static int tail_offset (const char *t, const char *s, unsigned n)
+{
+	unsigned m = strlen (t);
+	return n <= m && 0 == strcmp (t + m - n, s) ? (int) (m - n) : -1;
+}
+
+static void gen_string (const char *s)
+{
+	unsigned i, n = strlen (s);
+	int tail;
+	for (i = string_count; 0 < i; --i)
+		if (0 <= (tail = tail_offset ((const char *)the_store + strings[i-1],
+						s, n)))
+		{
+			gen (STRING_REF);
+			gen_ushort (strings[i-1] + tail);
+			return;
+		}
+	gen (PUSH_STRING);
+	if (available (n + 1))
+	{
+		/* A full pool just means later uses don't get to share it. */
+		if (string_count < max_strings)
+			strings[string_count++] = compiler_ptr - the_store;
+		memcpy (compiler_ptr, s, n + 1);
+		compiler_ptr += n + 1;
+	}
+}
+
+/* Store accounting
+
+   'report' prints where every byte of the store has gone: each
+   definition's code or data, and its header and name in the
+   dictionary, oldest first. The pooled string literals in a
+   procedure's code are counted apart from the rest of it; its memo
+   table if any follows the code and counts as data, as does whatever
+   Wren code allots by moving cp. */
+
+/* Where the start of a definition, or the bytes 'start' is in,
+   comes to an end: at the next definition, or cp. */
+static unsigned char *definition_end (const unsigned char *start)
 {
-	Instruc *ref = compiler_ptr;
-	compiler_ptr += sizeof (unsigned short);
-	return ref;
+	unsigned char *end = compiler_ptr;
+	const unsigned char *d = dictionary_ptr, *dict_end = store_end;
+	int pass;
+	if (start < fence && fence < end)
+		end = fence;
+	for (pass = 0; pass < 2; ++pass)
+	{
+		for (; d < dict_end; d = next_header (d))
+		{
+			const Header *h = (const Header *) d;
+			unsigned char *b = the_store + h->binding;
+			if (h->kind == a_procedure && indirect_calls)
+				b -= sizeof (unsigned short);
+			if ((h->kind == a_global || (h->kind == a_procedure && pass == 0))
+					&& start < b && b < end)
+				end = b;
+		}
+		d = rom_dictionary;
+		dict_end = rom_dictionary + rom_dictionary_size;
+	}
+	return end;
 }
 
-static void resolve (Instruc *ref)
+/* Return the bytes of pooled string literals in [start, end). */
+static unsigned string_bytes (const unsigned char *start, 
+		const unsigned char *end)
 {
-	if (loud)
-		printf ("ASM: %u\tresolved: %u\n", ref - the_store, compiler_ptr - ref);
-	*(unsigned short *)ref = compiler_ptr - ref;
+	unsigned i, total = 0;
+	for (i = 0; i < string_count; ++i)
+		if (start <= the_store + strings[i] && the_store + strings[i] < end)
+			total += strlen ((const char *)the_store + strings[i]) + 1;
+	return total;
 }
 
-static void block_prev (void)
+static void print_report (void)
 {
-	prev_instruc = NULL;	// The previous instruction isn't really known
+	const Header *defs[store_capacity / sizeof (Header)];
+	const unsigned char *d;
+	unsigned n = 0, code = 0, text = 0, data = 0;
+	for (d = dictionary_ptr; d < store_end; d = next_header (d))
+		if (n < sizeof defs / sizeof defs[0])
+			defs[n++] = (const Header *) d;
+	fprintf (output, "%-15s %6s %6s %6s %6s\n", 
+			"", "code", "string", "data", "header");
+	while (0 < n)
+	{
+		const Header *h = defs[--n];
+		unsigned char *start = the_store + h->binding, *end;
+		unsigned c = 0, t = 0;
+		if (h->kind == a_procedure)
+		{
+			Instruc *pc = start;
+			if (indirect_calls)
+				start -= sizeof (unsigned short);
+			end = definition_end (start);
+			while (pc < end && *pc != RETURN)
+				pc = next_instruc (pc);
+			if (pc < end)
+				++pc;
+			t = string_bytes (start, pc);
+			c = pc - start - t;
+		}
+		else
+			end = definition_end (start);
+		fprintf (output, "%-15.*s %6u %6u %6u %6u\n", 
+				h->name_length, h->name, c, t, 
+				(unsigned) (end - start) - c - t, 
+				(unsigned) (sizeof (Header) + h->name_length));
+		code += c;
+		text += t;
+		data += (end - start) - c - t;
+	}
+	if (rom_globals_count)
+		fprintf (output, "%-15s %6u %6u %6u %6u\n", "(rom globals)", 0, 0, 
+				(unsigned) (fence - the_store) - 4 * (unsigned) sizeof (Value), 0);
+	fprintf (output, "%-15s %6u %6u %6u %6u\n", "(total)", code, text, 
+			(unsigned) (compiler_ptr - the_store) - code - text, 
+			(unsigned) (store_end - dictionary_ptr));
+	fprintf (output, "%u bytes free; the stack has used at most %u.\n",
+			(unsigned) (dictionary_ptr - compiler_ptr), 
+			(unsigned) stack_high_water ());
 }
 
 /* Scanning */
@@ -513,12 +1956,21 @@ enum { unread = EOF - 1 };
 static int input_char = unread;
 static int token;
 static Value token_value;
-static char token_name[16];
+static char token_name[15];
+static unsigned token_length;	/* of token_name, which isn't '\0'-ended */
+static char token_string[max_string_size];
 
 static int ch (void)
 {
 	if (input_char == unread)
-		input_char = getc (stdin);
+	{
+		input_char = read_char ();
+		if (input_char == EOF && input_buffer && !input_buffer->closed)
+		{
+			starved = 1;
+			complain ("Incomplete input");
+		}
+	}
 	return input_char;
 }
 
@@ -534,16 +1986,58 @@ static void skip_line (void)
 		next_char ();
 }
 
+/* What each character can be, by table rather than <ctype.h>, which
+   would depend on the locale. */
+enum {
+	c_digit = 1, c_hex = 2, c_name = 4, c_space = 8, c_single = 16
+};
+
+static const unsigned char char_classes[256] = {  /* XXX gcc dependency */
+	['0' ... '9'] = c_digit | c_hex | c_name,
+	['A' ... 'F'] = c_hex | c_name, ['a' ... 'f'] = c_hex | c_name,
+	['G' ... 'Z'] = c_name, ['g' ... 'z'] = c_name, ['_'] = c_name,
+	[' '] = c_space, ['\t'] = c_space, ['\r'] = c_space,
+	['+'] = c_single, ['-'] = c_single, ['*'] = c_single, ['/'] = c_single,
+	['%'] = c_single, ['<'] = c_single, ['&'] = c_single, ['|'] = c_single,
+	['^'] = c_single, ['('] = c_single, [')'] = c_single, ['='] = c_single,
+	[':'] = c_single, [';'] = c_single, ['\n'] = c_single,
+};
+
+static unsigned char_class (int c)
+{
+	return (unsigned) c < sizeof char_classes ? char_classes[c] : 0;
+}
+
 static unsigned hex_char_value (char c)
 {
-	return c <= '9' ? c - '0' : toupper (c) - ('A'-10);
+	return c <= '9' ? c - '0' : (c | 0x20) - ('a'-10);
+}
+
+/* Return the token for the name just scanned: a keyword's, else 'a'. */
+static int keyword (const char *name, unsigned length)
+{
+#define KEYWORD(k, t) if (0 == memcmp (name, k, sizeof k - 1)) return t
+	switch (length)
+	{
+		case 2: KEYWORD ("if", 'i'); KEYWORD ("of", 'v'); 
+				KEYWORD ("or", 'O'); break;
+		case 3: KEYWORD ("let", 'l'); KEYWORD ("fun", 'f'); 
+				KEYWORD ("and", 'A'); break;
+		case 4: KEYWORD ("then", 't'); KEYWORD ("else", 'e'); 
+				KEYWORD ("memo", 'm'); KEYWORD ("case", 'c'); break;
+		case 6: KEYWORD ("forget", 'o'); break;
+	}
+	return 'a';
+#undef KEYWORD
 }
 
 static void next (void)
 {
+	unsigned c;
 again:
+	c = char_class (ch ());
 
-	if (isdigit (ch ()))
+	if (c & c_digit)
 	{
 		token = PUSH;
 		token_value = 0;
@@ -555,7 +2049,7 @@ again:
 				unsigned int digit_count = 0;
 				/* Oh, it's a hex literal, not decimal as we presumed. */
 				next_char ();
-				for (; isxdigit (ch ()); next_char ()) {
+				for (; char_class (ch ()) & c_hex; next_char ()) {
 					token_value = 16 * token_value + hex_char_value (ch ());
 					digit_count++;
 				}
@@ -574,35 +2068,36 @@ again:
 				complain ("Numeric overflow");
 				break;
 			}
-		} while (isdigit (ch ()));
+		} while (char_class (ch ()) & c_digit);
 	}
-	else if (isalpha (ch ()) || ch () == '_')
+	else if (c & c_name)
 	{
-		char *n = token_name;
+		token_length = 0;
 		do {
-			if (token_name + sizeof token_name == n + 1)
+			if (token_length == sizeof token_name)
 			{
 				complain ("Identifier too long");
 				break;
 			}
-			*n++ = ch ();
+			token_name[token_length++] = ch ();
 			next_char ();
-		} while (isalnum (ch ()) || ch () == '_');
-		*n++ = '\0';
-		if (0 == strcmp (token_name, "then"))
-			token = 't';
-		else if (0 == strcmp (token_name, "forget"))
-			token = 'o';
-		else if (0 == strcmp (token_name, "let"))
-			token = 'l';
-		else if (0 == strcmp (token_name, "if"))
-			token = 'i';
-		else if (0 == strcmp (token_name, "fun"))
-			token = 'f';
-		else if (0 == strcmp (token_name, "else"))
-			token = 'e';
-		else
-			token = 'a';
+		} while (char_class (ch ()) & c_name);
+		token = keyword (token_name, token_length);
+	}
+	else if (c & c_single)
+	{
+		token = ch ();
+		next_char ();
+		if (token == '-' && ch () == '>')
+		{
+			token = 'r';	/* '->' */
+			next_char ();
+		}
+	}
+	else if (c & c_space)
+	{
+		next_char ();
+		goto again;
 	}
 	else
 		switch (ch ())
@@ -610,11 +2105,7 @@ again:
 			case '\'':
 				next_char ();
 				{
-					/* We need to stick this string somewhere; after reaching
-					   the parser, if successfully parsed, it would be compiled
-					   into the instruction stream right after the next opcode.
-					   So just put it there -- but don't yet update compiler_ptr. */
-					unsigned char *s = compiler_ptr + 1;
+					char *s = token_string;
 					for (; ch () != '\''; next_char ())
 					{
 						if (ch () == EOF)
@@ -623,8 +2114,11 @@ again:
 							token = EOF;
 							return;
 						}
-						if (!available (s + 2 - compiler_ptr))
+						if (token_string + sizeof token_string == s + 1)
 						{
+							complain ("String too long");
+							skip_line ();
+							next_char ();
 							token = '\n';
 							return;
 						}
@@ -636,38 +2130,18 @@ again:
 				}
 				break;
 
-			case '+':
-			case '-':
-			case '*':
-			case '/':
-			case '%':
-			case '<':
-			case '&':
-			case '|':
-			case '^':
-			case '(':
-			case ')':
-			case '=':
-			case ':':
-			case ';':
-			case '\n':
 			case EOF:
-				token = ch ();
-				next_char ();
+				token = EOF;
 				break;
 
-			case ' ':
-			case '\t':
-			case '\r':
-				next_char ();
-				goto again;
-
 			case '#':
 				skip_line ();
 				goto again;
 
 			default:
 				complain ("Lexical error");
+				skip_line ();
+				next_char ();
 				token = '\n';  /* XXX need more for error recovery */
 				break;
 		}
@@ -699,6 +2173,8 @@ static void parse_arguments (unsigned arity)
 		parse_expr (20); /* 20 is higher than any operator precedence */
 }
 
+static void parse_case (void);
+
 static void parse_factor (void)
 {
 	skip_newline ();
@@ -708,7 +2184,7 @@ static void parse_factor (void)
 			if (token_value < 128 && token_value >= -128) {
 				gen (PUSHB);
 				gen_ubyte (token_value & 0xff);
-			} else if (token_value < 32768 && token_value >= -32768) {
+			} else if (token_value == (short) token_value) {
 				gen (PUSHW);
 				gen_ushort (token_value & 0xffff);
 			} else {
@@ -719,19 +2195,13 @@ static void parse_factor (void)
 			break;
 
 		case '\'':                  /* string constant */
-			gen (PUSH_STRING);
-			compiler_ptr += strlen ((const char *)compiler_ptr) + 1;
+			gen_string (token_string);
 			next ();
 			break;
 
 		case 'a':                   /* identifier */
 			{
-				const Header *h = lookup (dictionary_ptr, store_end,
-						token_name, strlen (token_name));
-				if (!h)
-					h = lookup (primitive_dictionary, 
-							primitive_dictionary + sizeof primitive_dictionary,
-							token_name, strlen (token_name));
+				const Header *h = lookup_name (token_name, token_length);
 				if (!h)
 					complain ("Unknown identifier");
 				else
@@ -801,6 +2271,10 @@ static void parse_factor (void)
 			}
 			break;
 
+		case 'c':                   /* case-of-else */
+			parse_case ();
+			break;
+
 		case '*':                   /* character fetch */
 			next ();
 			parse_factor ();
@@ -837,6 +2311,160 @@ static void parse_factor (void)
 	}
 }
 
+/* case <expr> of <key> -> <expr> | <key> -> <expr> ... else <expr>
+
+   The scrutinee is followed by a JUMP to the dispatch, then the arms,
+   each ending in a JUMP past the rest, then the dispatch, which falls
+   through into the else arm. The dispatch is a TABLESWITCH if that's
+   no bigger than a LOOKUPSWITCH on the same keys. */
+
+typedef struct CaseArm CaseArm;
+struct CaseArm {
+	Value key;
+	Instruc *code;
+};
+
+static void gen_switch (CaseArm *arms, unsigned n)
+{
+	Instruc *op = compiler_ptr;
+	unsigned i, j, range;
+	UValue span;
+	for (i = 1; i < n; ++i)		/* Sort by key */
+	{
+		CaseArm a = arms[i];
+		for (j = i; 0 < j && a.key < arms[j-1].key; --j)
+			arms[j] = arms[j-1];
+		arms[j] = a;
+	}
+	for (i = 1; i < n; ++i)
+		if (arms[i-1].key == arms[i].key)
+		{
+			complain ("Duplicate case");
+			return;
+		}
+	/* Subtracted unsigned, so it can't overflow; but span + 1 could
+	   still wrap to 0, so it has to be tested first. */
+	span = n ? (UValue) arms[n-1].key - (UValue) arms[0].key : 0;
+	range = span < 0xffff ? span + 1 : 0;
+	if (0 < n && 0 < range
+			&& sizeof (Value) + range * sizeof (short)
+				<= n * (sizeof (Value) + sizeof (short)))
+	{
+		/* A key in a gap goes on to the next instruction. */
+		unsigned short miss = 1 + sizeof (Value) + sizeof (unsigned short)
+			+ range * sizeof (short);
+		gen (TABLESWITCH);
+		gen_value (arms[0].key);
+		gen_ushort (range);
+		for (i = 0, j = 0; i < range; ++i)
+			if (arms[j].key == (Value) ((UValue) arms[0].key + i))
+				gen_ushort ((short) (arms[j++].code - op));
+			else
+				gen_ushort (miss);
+	}
+	else
+	{
+		gen (LOOKUPSWITCH);
+		gen_ushort (n);
+		for (i = 0; i < n; ++i)
+		{
+			gen_value (arms[i].key);
+			gen_ushort ((short) (arms[i].code - op));
+		}
+	}
+}
+
+static void parse_case (void)
+{
+	CaseArm arms[max_case_arms];
+	Instruc *jumps[max_case_arms];
+	Instruc *to_dispatch;
+	unsigned n = 0, i;
+	next ();
+	parse_expr (0);
+	gen (JUMP);
+	to_dispatch = forward_ref ();
+	skip_newline ();
+	if (!expect ('v', "Expected 'of'"))
+		return;
+	next ();
+	skip_newline ();
+	while (token != 'e' && !complaint)
+	{
+		int negative = token == '-';
+		if (negative)
+			next ();
+		if (!expect (PUSH, "Expected a constant"))
+			return;
+		if (n == max_case_arms)
+		{
+			complain ("Too many cases");
+			return;
+		}
+		arms[n].key = negative ? -token_value : token_value;
+		arms[n].code = compiler_ptr;
+		next ();
+		if (!expect ('r', "Expected '->'"))
+			return;
+		next ();
+		block_prev ();
+		parse_expr (10);	/* Above '|' */
+		gen (JUMP);
+		jumps[n++] = forward_ref ();
+		skip_newline ();
+		if (token == '|')
+		{
+			next ();
+			skip_newline ();
+		}
+		else if (token != 'e')
+			complain ("Expected '|' or 'else'");
+	}
+	if (complaint)
+		return;
+	next ();
+	resolve (to_dispatch);
+	gen_switch (arms, n);
+	block_prev ();
+	parse_expr (3);
+	for (i = 0; i < n; ++i)
+		resolve (jumps[i]);
+	block_prev ();
+}
+
+/* Compile the rest of 'a and b' or 'a or b', with a's code already
+   done: b runs only if a didn't settle it, and the result is 0 or 1. */
+static void parse_logical (int is_or, int precedence)
+{
+	Instruc *left, *right, *done, *done_too = NULL;
+	gen (BRANCH);
+	left = forward_ref ();
+	if (is_or)
+	{
+		gen (PUSHB);
+		gen_ubyte (1);
+		gen (JUMP);
+		done_too = forward_ref ();
+		resolve (left);
+	}
+	parse_expr (precedence + 1);
+	gen (BRANCH);
+	right = forward_ref ();
+	gen (PUSHB);
+	gen_ubyte (1);
+	gen (JUMP);
+	done = forward_ref ();
+	if (!is_or)
+		resolve (left);
+	resolve (right);
+	gen (PUSHB);
+	gen_ubyte (0);
+	resolve (done);
+	if (done_too)
+		resolve (done_too);
+	block_prev ();
+}
+
 static void parse_expr (int precedence) 
 {
 	if (complaint)
@@ -854,19 +2482,22 @@ static void parse_expr (int precedence)
 
 			case ':': l = 3; rator = GLOBAL_STORE; break;
 
-			case '&': l = 5; rator = AND; break;
-			case '|': l = 5; rator = OR;  break;
-			case '^': l = 5; rator = XOR; break;
+			case 'O': l = 5; rator = JUMP;   break;	/* 'or' */
+			case 'A': l = 7; rator = BRANCH; break;	/* 'and' */
 
-			case '<': l = 7; rator = LT;  break;
-			case '=': l = 7; rator = EQ;  break;
+			case '&': l = 9; rator = AND; break;
+			case '|': l = 9; rator = OR;  break;
+			case '^': l = 9; rator = XOR; break;
 
-			case '+': l = 9; rator = ADD; break;
-			case '-': l = 9; rator = SUB; break;
+			case '<': l = 11; rator = LT;  break;
+			case '=': l = 11; rator = EQ;  break;
 
-			case '*': l = 11; rator = MUL; break;
-			case '/': l = 11; rator = DIV; break;
-			case '%': l = 11; rator = MOD; break;
+			case '+': l = 13; rator = ADD; break;
+			case '-': l = 13; rator = SUB; break;
+
+			case '*': l = 15; rator = MUL; break;
+			case '/': l = 15; rator = DIV; break;
+			case '%': l = 15; rator = MOD; break;
 
 			default: return;
 		}
@@ -895,6 +2526,11 @@ static void parse_expr (int precedence)
 				break;
 			}
 		}
+		else if (rator == BRANCH || rator == JUMP)
+		{
+			parse_logical (rator == JUMP, l);
+			continue;
+		}
 		parse_expr (l + 1);
 		if (rator != POP)
 			gen (rator);
@@ -907,16 +2543,55 @@ static void parse_done (void)
 		complain ("Syntax error: unexpected token");
 }
 
+/* Move the scratch code in [start, end) up against the dictionary, out
+   of the way of anything it allots at cp, and return where it went.
+   Its jumps are relative, but STRING_REFs to its own literals need
+   moving too. The stack will go under it. */
+static Instruc *move_scratch (Instruc *start, Instruc *end)
+{
+	Instruc *code = the_store + 
+		((dictionary_ptr - (end - start) - the_store) & ~(sizeof (Value) - 1));
+	Instruc *pc;
+	if (code <= start)
+		return start;
+	memmove (code, start, end - start);
+	for (pc = code; *pc != HALT; pc = next_instruc (pc))
+		if (*pc == STRING_REF)
+		{
+			unsigned short *s = (unsigned short *)(pc + 1);
+			if (start - the_store <= *s && *s < end - the_store)
+				*s += code - start;
+		}
+	return code;
+}
+
 static Value scratch_expr (void)
 {
 	Instruc *start = compiler_ptr;
+	unsigned pool = string_count;
 	parse_expr (-1);
 	parse_done ();
 	gen (HALT);
 	{
-		Instruc *end = compiler_ptr;
+		Instruc *halt = compiler_ptr - 1;
+		Instruc *end, *code;
+		Value v;
+		end = compiler_ptr;
 		compiler_ptr = start;
-		return complaint ? 0 : run (start, end);
+		string_count = pool;	/* The literals go with the code */
+		if (complaint)
+			return 0;
+		code = move_scratch (start, end);
+		halt += code - start;
+		export_pointers ();
+		scratch_start = code;
+		scratch_end = code + (end - start);
+		ran = 1;
+		v = run_guarded (code, halt, compiler_ptr, code);
+		import_pointers ();
+		if (complaint && tracing)
+			dump_trace ();
+		return v;
 	}
 }
 
@@ -924,7 +2599,7 @@ static void run_expr (void)
 {
 	Value v = scratch_expr ();
 	if (!complaint)
-		printf ("%d\n", v);
+		fprintf (output, "%" PRIdValue "\n", v);
 }
 
 static void run_let (void)
@@ -934,7 +2609,7 @@ static void run_let (void)
 	{
 		unsigned char *cell = compiler_ptr;
 		gen_value (0);
-		bind (token_name, strlen (token_name),
+		bind_name (token_name, token_length,
 				a_global, cell - the_store, 0);
 		next ();
 		if (expect ('=', "Expected '='"))
@@ -950,22 +2625,29 @@ static void run_forget (void)
 	if (expect ('a', "Expected identifier"))
 	{
 		const Header *h = lookup (dictionary_ptr, store_end,
-				token_name, strlen (token_name));
+				token_name, token_length);
 		if (!h)
 			complain ("Unknown identifier");
 		else if (h->kind != a_global && h->kind != a_procedure)
 			complain ("Not a definition");
+		else if (the_store + h->binding < fence)
+			complain ("Can't forget that");
 		next ();
 		parse_done ();
 		if (!complaint)
 		{
-			unsigned char *cp = the_store + h->binding;
+			unsigned char *cp = the_store + h->binding 
+				- (indirect_calls && h->kind == a_procedure 
+						? sizeof (unsigned short) : 0);
 			unsigned char *dp = 
 				(unsigned char *) next_header ((const unsigned char *) h);
 			if (the_store <= cp && cp <= dp && dp <= store_end)
 			{
 				compiler_ptr = cp;
 				dictionary_ptr = dp;
+				forget_strings ();
+				if (indirect_calls)
+					relink_slots ();
 			}
 			else
 				complain ("Dictionary corrupted");
@@ -973,13 +2655,31 @@ static void run_forget (void)
 	}
 }
 
-static void run_fun (void)
+/* Turn each CALL in tail position from the procedure at 'entry' to
+   itself into a LOOP, which reuses the frame in place. All the loops
+   in Wren are written this way, so they get to run as loops. */
+static void convert_self_tail_calls (Instruc *entry, const Instruc *end)
+{
+	unsigned short binding = entry - the_store;
+	Instruc *pc;
+	for (pc = entry; pc < end; pc = next_instruc (pc))
+		if (*pc == CALL && *(unsigned short *)(pc + 2) == binding
+				&& *skip_jumps (pc + 2 + sizeof (unsigned short)) == RETURN)
+			*pc = LOOP;
+}
+
+/* Define a procedure; if 'memo' then it caches its results (see
+   MEMO_FETCH). */
+static void run_fun (int memo)
 {
 	if (expect ('a', "Expected identifier"))
 	{
 		unsigned char *dp = dictionary_ptr;
 		unsigned char *cp = compiler_ptr;
-		Header *f = bind (token_name, strlen (token_name),
+		Header *f;
+		if (indirect_calls)   /* the slot, pointing here for now */
+			gen_ushort (compiler_ptr + sizeof (unsigned short) - the_store);
+		f = bind_name (token_name, token_length,
 				a_procedure, compiler_ptr - the_store, 0);
 		next ();
 		if (f)
@@ -988,23 +2688,54 @@ static void run_fun (void)
 			while (token == 'a')
 			{
 				/* XXX check for too many parameters */
-				bind (token_name, strlen (token_name),
+				bind_name (token_name, token_length,
 						a_local, f->arity++, 0);
 				next ();
 			}
 			if (expect ('=', "Expected '='"))
 			{
+				Instruc *fetch = NULL, *store = NULL;
 				next ();
+				if (memo)
+				{
+					gen (MEMO_FETCH);
+					gen_ubyte (f->arity);
+					fetch = forward_ref ();
+				}
 				parse_expr (-1);
 				parse_done ();
+				if (memo)
+				{
+					gen (MEMO_STORE);
+					gen_ubyte (f->arity);
+					store = forward_ref ();
+				}
 				gen (RETURN);
+				if (!complaint)
+					convert_self_tail_calls (the_store + f->binding, 
+							compiler_ptr);
+				if (memo)
+				{
+					/* The table goes right after the code. */
+					unsigned size = memo_slots * (f->arity + 2) * sizeof (Value);
+					if (available (size))
+					{
+						*(unsigned short *)fetch = compiler_ptr - the_store;
+						*(unsigned short *)store = compiler_ptr - the_store;
+						memset (compiler_ptr, 0, size);
+						compiler_ptr += size;
+					}
+				}
 			}
 			dictionary_ptr = dp;  /* forget parameter names */
 		}
 		if (complaint) {
 			dictionary_ptr = dp;  /* forget function and code. */
 			compiler_ptr = cp;
+			forget_strings ();
 		}
+		else if (indirect_calls)
+			relink_slots ();
 	}
 }
 
@@ -1015,7 +2746,16 @@ static void run_command (void)
 	if (token == 'f')             /* 'fun' */
 	{
 		next ();
-		run_fun ();
+		run_fun (0);
+	}
+	else if (token == 'm')        /* 'memo fun' */
+	{
+		next ();
+		if (expect ('f', "Expected 'fun'"))
+		{
+			next ();
+			run_fun (1);
+		}
 	}
 	else if (token == 'l')        /* 'let' */
 	{
@@ -1030,42 +2770,505 @@ static void run_command (void)
 	else
 		run_expr ();
 
-	if (complaint)
+	if (complaint && token != '\n' && token != EOF)
 	{
-		printf ("%s\n", complaint);
-		skip_line ();  /* i.e., flush any buffered input, sort of */
+		/* Flush the rest of the line, sort of, but not into the next
+		   one: that may not have arrived yet. */
+		skip_line ();
 		next ();
 	}
+	if (complaint && (!starved || ran))
+		fprintf (output, "%s\n", complaint);
+}
+
+/* Dumping a ROM image
+
+   After compiling a library, 'wren -r' writes its procedures and
+   dictionary out as C source for rom.h. The code is relocated on the
+   way: calls get rom_flag set, calls in tail position are turned into
+   TCALLs now (ROM code can't be patched at runtime), and the library's
+   globals are renumbered into a packed block of cells right after the
+   built-in ones, where main() will put them. Anything else the library
+   allots in the store is lost, so a ROM library should stick to 'fun'
+   and 'let'. */
+
+static unsigned char *builtin_dp;	/* The dictionary before the library */
+
+/* A run of cells the library keeps in RAM: a global or a memo table. */
+typedef struct Cells Cells;
+struct Cells {
+	unsigned short binding, count;
+};
+
+static unsigned short relocate_cells (unsigned short binding, 
+		const Cells *cells, unsigned count)
+{
+	unsigned i, offset = fence - the_store;
+	for (i = 0; i < count; ++i)
+	{
+		if (cells[i].binding == binding)
+			return offset;
+		offset += cells[i].count * sizeof (Value);
+	}
+	return binding;
+}
+
+static void dump_rom (void)
+{
+	Cells cells[store_capacity / sizeof (Value)];
+	unsigned count = 0, total = 0, i, j;
+	const unsigned char *d;
+
+	for (d = dictionary_ptr; d < builtin_dp; d = next_header (d))
+		if (((const Header *) d)->kind == a_global)
+		{
+			cells[count].binding = ((const Header *) d)->binding;
+			cells[count++].count = 1;
+		}
+
+	for (d = dictionary_ptr; d < builtin_dp; d = next_header (d))
+	{
+		Header *h = (Header *) d;
+		Instruc *pc;
+		if (h->kind != a_procedure)
+			continue;
+		if (indirect_calls)
+			*(unsigned short *)(the_store + h->binding 
+					- sizeof (unsigned short)) |= rom_flag;
+		/* Each procedure ends with its only RETURN. */
+		for (pc = the_store + h->binding; *pc != RETURN; pc = next_instruc (pc))
+			switch (*pc)
+			{
+				case CALL:
+					if (*skip_jumps (pc + 2 + sizeof (unsigned short)) == RETURN)
+						*pc = TCALL;
+					/* fall through */
+				case TCALL:
+				case LOOP:
+					*(unsigned short *)(pc + 2) |= rom_flag;
+					break;
+				case STRING_REF:
+					*(unsigned short *)(pc + 1) |= rom_flag;
+					break;
+				case GLOBAL_FETCH:
+				case GLOBAL_STORE:
+					*(unsigned short *)(pc + 1) = relocate_cells 
+						(*(unsigned short *)(pc + 1), cells, count);
+					break;
+				case MEMO_FETCH:
+					cells[count].binding = *(unsigned short *)(pc + 2);
+					cells[count++].count = memo_slots * (pc[1] + 2);
+					/* fall through */
+				case MEMO_STORE:
+					*(unsigned short *)(pc + 2) = relocate_cells 
+						(*(unsigned short *)(pc + 2), cells, count);
+					break;
+			}
+	}
+	for (i = 0; i < count; ++i)
+		total += cells[i].count;
+
+	printf ("/* A preloaded library for wren.c, generated by 'wren -r'. */\n\n");
+	printf ("enum { rom_code_size = %u, rom_dictionary_size = %u,"
+			" rom_globals_count = %u };\n\n",
+			(unsigned) (compiler_ptr - the_store),
+			(unsigned) (builtin_dp - dictionary_ptr), total);
+	printf ("static const Instruc rom_code[] = {");
+	for (i = 0; the_store + i < compiler_ptr; ++i)
+		printf ("%s%u,", i % 16 ? " " : "\n\t", 
+				the_store + i < fence ? 0 : the_store[i]);
+	printf ("\n};\n\nstatic const unsigned char rom_dictionary[] = {");
+	for (d = dictionary_ptr, i = 0; d < builtin_dp; d = next_header (d))
+	{
+		Header *h = (Header *) d;
+		if (h->kind == a_procedure)
+			h->binding |= rom_flag;
+		else if (h->kind == a_global)
+			h->binding = relocate_cells (h->binding, cells, count);
+	}
+	for (d = dictionary_ptr, i = 0; d < builtin_dp; ++d, ++i)
+		printf ("%s%u,", i % 16 ? " " : "\n\t", *d);
+	printf ("\n};\n\nstatic const Value rom_globals[] = {");
+	for (i = 0, total = 0; i < count; ++i)
+		for (j = 0; j < cells[i].count; ++j, ++total)
+			printf ("%s%" PRIdValue ",", total % 8 ? " " : "\n\t", 
+					((Value *)(the_store + cells[i].binding))[j]);
+	printf ("%s\n};\n", total ? "" : " 0");
 }
 
 /* The top level */
+static const char *prompt = "> ";
+
 static void read_eval_print_loop (void)
 {
-	printf ("> ");
+	fputs (prompt, output);
 	next_char ();
 	complaint = NULL;
 	next ();
 	while (token != EOF)
 	{
 		run_command ();
-		printf ("> ");
+		fputs (prompt, output);
+		complaint = NULL;
 		skip_newline ();
+	}
+	fputs (*prompt ? "\n" : "", output);
+}
+
+#ifndef NO_SERVER
+/* Server mode
+
+   'wren -s path library' compiles the library once, then listens on a
+   Unix domain socket at path, giving each client a session much like
+   the top level on stdin. The library's code and dictionary stay put
+   in the store, shared by every session; each session's own
+   definitions live above and below them only while it's being served,
+   and the rest of the time they're swapped out to a copy of just
+   those bytes. So are its values of the library's global variables
+   and memo tables. A command runs once all of it has arrived, so one
+   slow client never holds up the others. */
+
+typedef struct Session Session;
+struct Session {
+	int fd;
+	FILE *out;
+	Input in;
+	unsigned char *code, *dict;	/* Swapped-out definitions */
+	unsigned code_size, dict_size;
+	unsigned short *strings;	/* and its literals */
+	unsigned string_count;
+	Value *data;	/* Its values of library_data */
+};
+
+static Session *sessions[max_sessions];
+static unsigned char *library_cp, *library_dp;
+static unsigned library_strings;
+
+/* The library's cells, as runs of Values: c0, d0 and any ROM globals,
+   then each global and memo table in the library's dictionary. */
+static Cells library_data[store_capacity / sizeof (Value)];
+static unsigned library_runs, library_cells;
+static Value *library_values;	/* As the library left them */
+
+static void find_library_data (void)
+{
+	const unsigned char *d;
+	unsigned i;
+	library_data[0].binding = 2 * sizeof (Value);
+	library_data[0].count = 2 + rom_globals_count;
+	library_runs = 1;
+	for (d = library_dp; d < builtin_dp; d = next_header (d))
+	{
+		const Header *h = (const Header *) d;
+		const Instruc *pc;
+		if (h->kind == a_global)
+		{
+			library_data[library_runs].binding = h->binding;
+			library_data[library_runs++].count = 1;
+		}
+		else if (h->kind == a_procedure)
+			for (pc = the_store + h->binding; *pc != RETURN; 
+					pc = next_instruc ((Instruc *) pc))
+				if (*pc == MEMO_FETCH)
+				{
+					library_data[library_runs].binding = 
+						*(unsigned short *)(pc + 2);
+					library_data[library_runs++].count = 
+						memo_slots * (pc[1] + 2);
+				}
+	}
+	for (i = 0; i < library_runs; ++i)
+		library_cells += library_data[i].count;
+}
+
+/* Copy the library's cells to 'values', or if 'in' back from it. */
+static void swap_data (Value *values, int in)
+{
+	unsigned i;
+	for (i = 0; i < library_runs; ++i)
+	{
+		Value *cells = (Value *) (the_store + library_data[i].binding);
+		size_t size = library_data[i].count * sizeof (Value);
+		if (in)
+			memcpy (cells, values, size);
+		else
+			memcpy (values, cells, size);
+		values += library_data[i].count;
+	}
+}
+
+static void swap_in (Session *s)
+{
+	compiler_ptr = library_cp + s->code_size;
+	dictionary_ptr = library_dp - s->dict_size;
+	memcpy (library_cp, s->code, s->code_size);
+	memcpy (dictionary_ptr, s->dict, s->dict_size);
+	string_count = library_strings + s->string_count;
+	memcpy (strings + library_strings, s->strings, 
+			s->string_count * sizeof *strings);
+	swap_data (s->data, 1);
+}
+
+static int swap_out (Session *s)
+{
+	/* Wren code can set cp and dp to anything; don't let it take
+	   the library with it. */
+	if (compiler_ptr < library_cp || dictionary_ptr < compiler_ptr)
+		compiler_ptr = library_cp;
+	if (library_dp < dictionary_ptr || dictionary_ptr < compiler_ptr)
+		dictionary_ptr = library_dp;
+	forget_strings ();
+	s->code_size = compiler_ptr - library_cp;
+	s->dict_size = library_dp - dictionary_ptr;
+	s->code = realloc (s->code, s->code_size + 1);
+	s->dict = realloc (s->dict, s->dict_size + 1);
+	s->string_count = string_count - library_strings;
+	s->strings = realloc (s->strings, 
+			(s->string_count + 1) * sizeof *strings);
+	if (!s->code || !s->dict || !s->strings)
+		return 0;
+	memcpy (s->code, library_cp, s->code_size);
+	memcpy (s->dict, dictionary_ptr, s->dict_size);
+	memcpy (s->strings, strings + library_strings, 
+			s->string_count * sizeof *strings);
+	swap_data (s->data, 0);
+	return 1;
+}
+
+/* Run every command that has fully arrived. Return false once the
+   session is over. */
+static int serve (Session *s)
+{
+	Input *in = &s->in;
+	swap_in (s);
+	input_buffer = in;
+	output = s->out;
+	for (;;)
+	{
+		unsigned position = in->position;
+		unsigned char *cp = compiler_ptr;
+		unsigned char *dp = dictionary_ptr;
+		if (!in->closed && !memchr (in->bytes + position, '\n', 
+					in->length - position))
+			break;
+		starved = 0;
+		ran = 0;
 		complaint = NULL;
+		input_char = unread;
+		next ();
+		skip_newline ();
+		if (token == EOF)
+			break;
+		run_command ();
+		if (starved && !ran)
+		{
+			/* Try again when there's more. */
+			in->position = position;
+			compiler_ptr = cp;
+			dictionary_ptr = dp;
+			break;
+		}
+		fputs (prompt, output);
+	}
+	fflush (output);
+	input_buffer = NULL;
+	output = stdout;
+	return swap_out (s) && !(in->closed && in->position == in->length);
+}
+
+static void end_session (unsigned i)
+{
+	Session *s = sessions[i];
+	fclose (s->out);
+	free (s->in.bytes);
+	free (s->code);
+	free (s->dict);
+	free (s->strings);
+	free (s->data);
+	free (s);
+	sessions[i] = NULL;
+}
+
+static void accept_session (int listener)
+{
+	unsigned i;
+	int fd = accept (listener, NULL, NULL);
+	if (fd < 0)
+		return;
+	for (i = 0; i < max_sessions; ++i)
+		if (!sessions[i])
+		{
+			Session *s = calloc (1, sizeof *s);
+			if (s && (s->data = malloc (library_cells * sizeof (Value) + 1))
+					&& (s->in.bytes = malloc (session_input_size))
+					&& (s->out = fdopen (fd, "w")))
+			{
+				s->in.size = session_input_size;
+				memcpy (s->data, library_values, library_cells * sizeof (Value));
+				sessions[i] = s;
+				s->fd = fd;
+				fputs (prompt, s->out);
+				fflush (s->out);
+				return;
+			}
+			if (s)
+			{
+				free (s->data);
+				free (s->in.bytes);
+			}
+			free (s);
+			break;
+		}
+	close (fd);
+}
+
+static void receive (unsigned i)
+{
+	Session *s = sessions[i];
+	Input *in = &s->in;
+	ssize_t n;
+	memmove (in->bytes, in->bytes + in->position, in->length - in->position);
+	in->length -= in->position;
+	in->position = 0;
+	if (in->length == in->size)
+	{
+		/* Make room for more of a long command, unless it's already
+		   too big to ever compile: then give up on it. */
+		unsigned size = in->size < store_capacity / 2 
+			? 2 * in->size : store_capacity;
+		unsigned char *bytes = in->size < size 
+			? realloc (in->bytes, size) : NULL;
+		if (bytes)
+		{
+			in->bytes = bytes;
+			in->size = size;
+		}
+		else
+		{
+			in->length = 0;
+			fputs ("Input too long\n", s->out);
+		}
+	}
+	n = read (s->fd, in->bytes + in->length, in->size - in->length);
+	if (n <= 0)
+		in->closed = 1;
+	else
+		in->length += n;
+	if (!serve (s))
+		end_session (i);
+}
+
+static int run_server (const char *path)
+{
+	struct sockaddr_un addr;
+	struct pollfd fds[1 + max_sessions];
+	int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || sizeof addr.sun_path <= strlen (path))
+		return 0;
+	memset (&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+	unlink (path);
+	if (bind (listener, (struct sockaddr *) &addr, sizeof addr) < 0
+			|| listen (listener, max_sessions) < 0)
+		return 0;
+	signal (SIGPIPE, SIG_IGN);
+	library_cp = compiler_ptr;
+	library_dp = dictionary_ptr;
+	library_strings = string_count;
+	fence = compiler_ptr;
+	find_library_data ();
+	if (!(library_values = malloc (library_cells * sizeof (Value) + 1)))
+		return 0;
+	swap_data (library_values, 0);
+	for (;;)
+	{
+		unsigned i, n = 0;
+		fds[n].fd = listener;
+		fds[n++].events = POLLIN;
+		for (i = 0; i < max_sessions; ++i)
+			if (sessions[i])
+			{
+				fds[n].fd = sessions[i]->fd;
+				fds[n++].events = POLLIN;
+			}
+		if (poll (fds, n, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		for (i = 0, n = 1; i < max_sessions; ++i)
+			if (sessions[i] && fds[n++].revents)
+				receive (i);
+		if (fds[0].revents & POLLIN)
+			accept_session (listener);
 	}
-	printf ("\n");
 }
+#endif
 
-int main ()
+int main (int argc, char **argv)
 {
-	((Value *)the_store)[2] = (unsigned int) the_store;
-	((Value *)the_store)[3] = (unsigned int) store_end;
+	input = stdin;
+	output = stdout;
+	if (time_slice)
+		signal (SIGINT, interrupt_handler);
+#ifdef SIGUSR1
+	signal (SIGUSR1, trace_handler);
+#endif
+	if (vm_stack_size && !map_vm_stacks ())
+	{
+		perror ("wren: can't map the stacks");
+		return 1;
+	}
+	assert ((unsigned) store_capacity <= rom_flag);
+	assert (store_capacity <= (UValue) ~(UValue) 0 >> 1);
+	((Value *)the_store)[2] = 0;
+	((Value *)the_store)[3] = store_capacity;
 	dictionary_ptr = store_end;
-	bind ("cp", 2, a_global, 0, 0);
-	bind ("dp", 2, a_global, 4, 0);
-	bind ("c0", 2, a_global, 8, 0);
-	bind ("d0", 2, a_global, 12,0);
+	bind_name ("cp", 2, a_global, 0, 0);
+	bind_name ("dp", 2, a_global, sizeof (Value), 0);
+	bind_name ("c0", 2, a_global, 2*sizeof (Value), 0);
+	bind_name ("d0", 2, a_global, 3*sizeof (Value), 0);
 
 	compiler_ptr = the_store + 4*sizeof (Value);
+	fence = compiler_ptr;
+	builtin_dp = dictionary_ptr;
+	if (argc == 3 && 0 == strcmp (argv[1], "-r"))
+	{
+		if (!(input = fopen (argv[2], "r")))
+		{
+			perror (argv[2]);
+			return 1;
+		}
+		output = stderr;
+		prompt = "";
+		read_eval_print_loop ();
+		dump_rom ();
+		return 0;
+	}
+	memcpy (compiler_ptr, rom_globals, rom_globals_count * sizeof (Value));
+	compiler_ptr += rom_globals_count * sizeof (Value);
+	fence = compiler_ptr;
+#ifndef NO_SERVER
+	if (argc == 4 && 0 == strcmp (argv[1], "-s"))
+	{
+		if (!(input = fopen (argv[3], "r")))
+		{
+			perror (argv[3]);
+			return 1;
+		}
+		prompt = "";
+		read_eval_print_loop ();
+		fclose (input);
+		prompt = "> ";
+		run_server (argv[2]);
+		perror (argv[2]);
+		return 1;
+	}
+#endif
+	(void) argc;
+	(void) argv;
 	read_eval_print_loop ();
 	return 0;
 }